@@ -2,31 +2,147 @@
 
 #include <gtk/gtk.h>
 #include <stack>
+#include <deque>
+#include <vector>
+#include <memory>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
 #include "miniaudio.h"
 #include "glib/gprintf.h"
 
-#define DEVICE_FORMAT       ma_format_f32
-#define SAMPLE_FORMAT       ma_format_f32
-#define DEVICE_CHANNELS     1
-#define DEVICE_SAMPLE_RATE  48000
-#define EXPORT_FORMAT       ma_format_f32
-#define EXPORT_CHANNELS     1
-#define EXPORT_SAMPLE_RATE  48000
+#if defined(__x86_64__) || defined(__i386__)
+#define SILLY_SYNTH_X86
+#include <immintrin.h>
+#endif
+
+#if defined(__unix__) || defined(__APPLE__)
+#define SILLY_SYNTH_MMAP
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+#define MAX_CHANNELS        2
+#define EXPORT_BLOCK_FRAMES 4096
+#define EXPORT_SEGMENT_BLOCKS 16 // blocks in each buffer an export thread renders and the encoder writes
+#define WAV_HEADER_BYTES    44
+#define RESAMPLER_BLOCK_FRAMES 4096
+#define COMMAND_QUEUE_SIZE  4096 // must be a power of two
+#define COMMAND_RETRY_INTERVAL 10 // ms between tries to move held commands into a full ring
+#define MAX_PIANO_KEYS      128  // one bit per key in a KeyMask
+#define KEY_MASK_WORDS      (MAX_PIANO_KEYS / 64)
+#define NOTE_INDEX_BUCKET_COLUMNS 16
+#define MAX_VOICES          32
+#define VOICE_AMPLITUDE     0.2
+#define VOICE_ATTACK_TIME   0.002 // seconds a voice takes to reach full level after note on
+#define VOICE_DECAY_TIME    0.1  // seconds it then takes to fall to the sustain level
+#define VOICE_RELEASE_TIME  0.01 // seconds a voice takes to fade out after note off
+#define MIX_BUS_ALIGNMENT   64
+#define MIX_BUS_MIN_FRAMES  256
+#define MIX_BUSES           4    // tracks a note can play on, each summed into the output with its own gain
+#define MIXER_BLOCK_FRAMES  4096 // most frames the voices are mixed in one go
+#define HALFBAND_TAPS       32   // of the last halving when oversampling, not counting the middle one
+#define HALFBAND_SHORT_TAPS 16   // of the first halving at 4x
+#define HALFBAND_BETA       8.0  // of their kaiser windows
+#define WAVETABLE_SIZE      2048
+#define WAVETABLE_LEVELS    10   // one table per octave, the first one has WAVETABLE_MAX_HARMONICS
+#define WAVETABLE_MAX_HARMONICS 512
+#define LOAD_HISTOGRAM_BUCKETS 16   // each bucket is LOAD_HISTOGRAM_STEP of the period budget, the last one holds everything above
+#define LOAD_HISTOGRAM_STEP    0.1
+#define LOAD_METER_INTERVAL    250  // ms between updates of the on-screen meter
+#define EXPORT_PROGRESS_INTERVAL 100 // ms between updates of the export progress
+#define PIANO_ROLL_TILE_SIZE  256 // pixels along each side of a cached tile of the roll
+#define PIANO_ROLL_MAX_TILES  96  // tiles kept cached, more only if that many are in view at once
+#define PIANO_ROLL_COLUMN_WIDTH     24.0  // pixels a column starts out as
+#define PIANO_ROLL_MIN_COLUMN_WIDTH 2.0   // how far ctrl + scroll zooms out
+#define PIANO_ROLL_MAX_COLUMN_WIDTH 200.0 // and in
+#define PIANO_ROLL_ZOOM_STEP        1.25  // column width change per scroll step
+#define PIANO_ROLL_MIN_KEY_HEIGHT   12.0  // keys don't get shorter than this, the roll scrolls up and down instead
+#define PIANO_ROLL_SCROLL_STEP      3.0   // columns or keys per scroll step
+#define DRAW_BENCH_WIDTH    1920 // size of the roll the draw benchmark renders
+#define DRAW_BENCH_HEIGHT   1080
+#define DRAW_BENCH_FRAMES   60   // each kind of frame is timed over this many and averaged
+#define DRAW_BENCH_MAX_SCALE 2   // and it is timed at every scale factor up to this one
+#define SYNTH_BENCH_VOICES  16      // voices the synth benchmark renders at once
+#define SYNTH_BENCH_FRAMES  1048576 // frames each kernel is timed over
+#define SYNTH_BENCH_CALLS   8       // kernel calls of different lengths each voice is checked over
+#define SYNTH_BENCH_TOLERANCE 1e-2  // most a vector kernel may be off from the scalar one
+#define SYNTH_BENCH_JUMP_WINDOW 1e-3 // phases this close to the jump of a square or saw aren't compared
+#define ALIAS_BENCH_FREQUENCY 3731.0 // the note aliasing is measured on, high enough for a lot of it to fold back
+#define ALIAS_BENCH_FRAMES    8192   // at 48000 Hz, one dft of this many
+#define ALIAS_BENCH_BETA      20.0   // of the kaiser window, its sidelobes are far under any of the aliasing
+#define ALIAS_BENCH_MAINLOBE  8      // bins either side of a harmonic that still count as that harmonic
 
 using namespace std;
 
 // g++ $( pkg-config --cflags gtk4 ) -o silly_synth silly_synth.cpp $( pkg-config --libs gtk4 ) -ldl -lm -lpthread
+// ./silly_synth --render song.ssy -o out.wav [-j threads] [--no-mmap] renders a saved song to a wav file without a window or audio device,
+// and --rate, --channels and --format pick what gets exported (--render-rate renders at another rate and resamples).
+// ./silly_synth --bench-draw times the piano roll renderer on large grids, also without a window
+// ./silly_synth --bench-synth times the oscillator kernels, checks the vector ones against the scalar ones and
+// measures how much the square and saw instruments alias
+// --oversample and --device-oversample run the synth at 2x or 4x the rate and decimate, for export and live playback
+// --voices caps how many notes sound at once and --steal picks the voice a new note takes once they are all busy
+
+// a bit mask of the keys that are on in one column, 64 keys to a word
+struct KeyMask
+{
+  ma_uint64 words[KEY_MASK_WORDS];
+};
+
+// a note that starts at a column and is held for length columns
+struct NoteEvent
+{
+  int start;
+  int length;
+  int key;
+  float velocity;
+  float pan; // -1 is left, 1 is right
+  int bus;   // the mixer bus (track) the note plays on
+};
+
+// the notes overlapping one bucket of columns, sorted by start and then key
+struct NoteBucket
+{
+  vector<NoteEvent> events;
+};
 
-int playbackX = 0;
+// the notes of a song. Bucket b covers the columns [b * NOTE_INDEX_BUCKET_COLUMNS, (b + 1) * NOTE_INDEX_BUCKET_COLUMNS)
+// and holds every note that overlaps them, so a held note is in each bucket it crosses. Buckets are shared between
+// copies of a store and copied on write: copying a store only copies the pointers, and an edit only copies the
+// buckets it changes. Memory grows with the number of notes, not with how long the song is
+struct NoteStore
+{
+  vector<shared_ptr<NoteBucket>> buckets; // NULL where there are no notes
+  int noteCount = 0;
+  float busGains[MIX_BUSES] = {1.0f, 1.0f, 1.0f, 1.0f};
+};
 
-bool** notes;
+NoteStore notes;
 
 int pianoKeyCount = 25; // two octaves + extra C
 int pianoGridWidth = 32; // arbitrary for now before scrubbing is implemented
 int baseKeyNote = 48; // C3
 int pianoRollBorder = 100;
 double tempo = 8.0; // TODO (this is in grid spaces per second)
-int previousFrameTime;
+
+// the synth always renders a stereo float mix at the rate it is given: each note is panned into its bus and the
+// buses are summed into a left and a right channel. These say what the device and exported files get. For one
+// channel left and right are averaged down to mono, otherwise they go to the even and odd channels, and the
+// result is converted to the sample format on the way out
+ma_uint32 deviceSampleRate = 48000;
+ma_uint32 deviceChannels = 1;
+ma_uint32 exportSampleRate = 48000;
+ma_uint32 exportChannels = 1;
+ma_format exportFormat = ma_format_f32;
+
+const ma_uint32 supportedSampleRates[] = {44100, 48000, 96000};
+const ma_format supportedExportFormats[] = {ma_format_f32, ma_format_s16, ma_format_s24};
+const char* exportFormatNames[] = {"f32", "s16", "s24"};
 
 
 
@@ -43,653 +159,4468 @@ double pitch_from_note(int note)
 
 
 
-double scrubberPosition = 0.0;
-int scrubberWidth = 5;
-int scrubberHeightOffset = 20;
-double playbackTime = 0.0; // in seconds I think
-bool playing = false;
-bool exporting = false;
-
-ma_device device;
-
-
-
-float microseconds_to_seconds(int ms)
+int note_end(const NoteEvent& e)
 {
-  return ms * 0.000001f;
+  return e.start + e.length;
 }
 
-static void start_playback(GtkWidget* widget, gpointer data)
+bool note_before(const NoteEvent& a, const NoteEvent& b)
 {
-  playing = true;  
-  g_print("now playing!\n");
-  previousFrameTime = -1;
-  playbackX = 0;
+  return a.start < b.start || (a.start == b.start && a.key < b.key);
 }
 
-static void stop_playback(GtkWidget* widget, gpointer data)
+// the bucket covering column, or NULL if no note is there
+const NoteBucket* get_bucket(const NoteStore* store, int column)
 {
-  playing = false;  
-  g_print("stopped playing\n");
-  gtk_widget_queue_draw(GTK_WIDGET(data));  
+  int b = column / NOTE_INDEX_BUCKET_COLUMNS;
+  if (column < 0 || b >= (int) store->buckets.size())
+  {
+    return NULL;
+  }
+  return store->buckets[b].get();
 }
 
-static void reset_playback(GtkWidget* widget, gpointer data)
+// bucket b, ready to be changed. It is copied first if another store shares it
+NoteBucket* edit_bucket(NoteStore* store, int b)
 {
-  playing = false;
-  playbackTime = 0.0;
-  scrubberPosition = 0.0;
-  gtk_widget_queue_draw(GTK_WIDGET(data));  
-  g_print("reset\n");
+  if (b >= (int) store->buckets.size())
+  {
+    store->buckets.resize(b + 1);
+  }
+  shared_ptr<NoteBucket>& bucket = store->buckets[b];
+  if (bucket == NULL)
+  {
+    bucket = make_shared<NoteBucket>();
+  }
+  else if (bucket.use_count() > 1)
+  {
+    bucket = make_shared<NoteBucket>(*bucket);
+  }
+  return bucket.get();
 }
 
-static void edit_note(GtkWidget* widget)
+void add_note(NoteStore* store, const NoteEvent& note)
 {
-  
+  for (int b = note.start / NOTE_INDEX_BUCKET_COLUMNS; b <= (note_end(note) - 1) / NOTE_INDEX_BUCKET_COLUMNS; b++)
+  {
+    vector<NoteEvent>& events = edit_bucket(store, b)->events;
+    events.insert(std::upper_bound(events.begin(), events.end(), note, note_before), note);
+  }
+  store->noteCount++;
 }
 
-bool get_note(int x, int y)
+// removes the note with the same start and key as note
+void remove_note(NoteStore* store, const NoteEvent& note)
 {
-  if (x < 0 || x >= pianoGridWidth || y < 0 || y >= pianoKeyCount)
+  for (int b = note.start / NOTE_INDEX_BUCKET_COLUMNS; b <= (note_end(note) - 1) / NOTE_INDEX_BUCKET_COLUMNS; b++)
   {
-    return false;
+    vector<NoteEvent>& events = edit_bucket(store, b)->events;
+    events.erase(std::lower_bound(events.begin(), events.end(), note, note_before));
+    if (events.empty())
+    {
+      store->buckets[b] = NULL;
+    }
   }
-  return notes[x][y];
+  store->noteCount--;
 }
 
-void set_note(int x, int y, bool value)
+// every note of store, sorted by start and then key
+vector<NoteEvent> get_store_notes(const NoteStore* store)
 {
-  if (x < 0 || x >= pianoGridWidth || y < 0 || y >= pianoKeyCount)
+  vector<NoteEvent> events;
+  events.reserve(store->noteCount);
+  for (int b = 0; b < (int) store->buckets.size(); b++)
   {
-    return;
+    if (store->buckets[b] == NULL)
+    {
+      continue;
+    }
+    for (const NoteEvent& e : store->buckets[b]->events)
+    {
+      // a note is in every bucket it crosses, so only take it from the one it starts in
+      if (e.start / NOTE_INDEX_BUCKET_COLUMNS == b)
+      {
+        events.push_back(e);
+      }
+    }
   }
-  notes[x][y] = value;
+  return events;
 }
 
-void toggle_note(int x, int y)
+// replaces the notes of store with events
+void set_store_notes(NoteStore* store, const vector<NoteEvent>& events)
 {
-  if (x < 0 || x >= pianoGridWidth || y < 0 || y >= pianoKeyCount)
+  store->buckets.clear();
+  store->noteCount = 0;
+  for (const NoteEvent& e : events)
   {
-    return;
+    add_note(store, e);
   }
-  notes[x][y] = !notes[x][y];
-  // g_print("note toggled\n");
 }
 
-enum ActionType
+// the note holding key at column, or NULL. It is only valid until the store is next edited
+const NoteEvent* find_note(const NoteStore* store, int column, int key)
 {
-  TOGGLE_NOTE,
-  ADD_NOTE,
-  REMOVE_NOTE,
-  CLEAR_NOTES
-};
+  const NoteBucket* bucket = get_bucket(store, column);
+  if (bucket == NULL)
+  {
+    return NULL;
+  }
+  for (const NoteEvent& e : bucket->events)
+  {
+    if (e.key == key && e.start <= column && column < note_end(e))
+    {
+      return &e;
+    }
+  }
+  return NULL;
+}
 
-struct Action
+// which keys are sounding at column. Safe to call from the audio thread, it never allocates.
+// If velocities is given, the velocity of every sounding key is written to it
+KeyMask get_column_mask(const NoteStore* store, int column, float* velocities = NULL)
 {
-  ActionType type;
-  int data1;
-  int data2;
-};
+  const NoteBucket* bucket = get_bucket(store, column);
+  if (bucket == NULL)
+  {
+    return KeyMask{};
+  }
+  KeyMask mask = {};
+  for (const NoteEvent& e : bucket->events)
+  {
+    if (e.start <= column && column < note_end(e))
+    {
+      mask.words[e.key / 64] |= (ma_uint64) 1 << (e.key % 64);
+      if (velocities != NULL)
+      {
+        velocities[e.key] = e.velocity;
+      }
+    }
+  }
+  return mask;
+}
 
+bool key_in_mask(const KeyMask& mask, int key)
+{
+  return (mask.words[key / 64] >> (key % 64)) & 1;
+}
 
+void set_key_in_mask(KeyMask* mask, int key, bool on)
+{
+  if (on)
+  {
+    mask->words[key / 64] |= (ma_uint64) 1 << (key % 64);
+  }
+  else
+  {
+    mask->words[key / 64] &= ~((ma_uint64) 1 << (key % 64));
+  }
+}
 
-stack<Action> undoStack;
-stack<Action> redoStack;
-bool hasSavedNotes = false;
-bool** savedNotes; // allows for ONE undo of a clear action
+// the first key from key up that is on in mask (or off, if on is false), or MAX_PIANO_KEYS if there is none
+int next_key_in_mask(const KeyMask& mask, int key, bool on)
+{
+  while (key < MAX_PIANO_KEYS)
+  {
+    ma_uint64 word = on ? mask.words[key / 64] : ~mask.words[key / 64];
+    word &= ~(ma_uint64) 0 << (key % 64);
+    if (word != 0)
+    {
+      return key / 64 * 64 + __builtin_ctzll(word);
+    }
+    key = (key / 64 + 1) * 64;
+  }
+  return MAX_PIANO_KEYS;
+}
 
-static void clear_redo_stack()
+// notes that touch are only merged if they sound the same
+bool same_note_settings(const NoteEvent& a, const NoteEvent& b)
 {
-  redoStack = stack<Action>();
+  return a.velocity == b.velocity && a.pan == b.pan && a.bus == b.bus;
 }
 
-static void undo(GtkWidget* widget, gpointer data)
+// turns one cell of the roll on or off. Held notes get split or merged so that neighbouring cells
+// on the same key (with the same velocity, pan and bus) are always a single note
+void set_store_note(NoteStore* store, int column, int key, bool value, float velocity = 1.0f, float pan = 0.0f,
+                    int bus = 0)
 {
-  if (undoStack.empty())
+  const NoteEvent* found = find_note(store, column, key);
+  if (value == (found != NULL))
   {
     return;
   }
 
-  Action a = undoStack.top();
-  undoStack.pop();
-  redoStack.push(a);
-
-  // perform undo operation
-  switch (a.type)
+  // only the buckets under the notes that change are touched
+  if (!value)
   {
-    case TOGGLE_NOTE:
+    NoteEvent e = *found;
+    remove_note(store, e);
+    if (column > e.start)
     {
-      toggle_note(a.data1, a.data2);
-      break;
+      NoteEvent before = e;
+      before.length = column - e.start;
+      add_note(store, before);
     }
-    case ADD_NOTE:
+    if (column + 1 < note_end(e))
     {
-      set_note(a.data1, a.data2, false);
-      break;
+      NoteEvent after = e;
+      after.start = column + 1;
+      after.length = note_end(e) - column - 1;
+      add_note(store, after);
     }
-    case REMOVE_NOTE:
+  }
+  else
+  {
+    NoteEvent note = {column, 1, key, velocity, pan, bus};
+    // the neighbours are copied before removing them, since that can move the notes found points at
+    found = find_note(store, column + 1, key);
+    if (found != NULL && same_note_settings(*found, note))
     {
-      set_note(a.data1, a.data2, true);
-      break;
+      NoteEvent after = *found;
+      remove_note(store, after);
+      note.length += after.length;
     }
-    case CLEAR_NOTES:
+    found = find_note(store, column - 1, key);
+    if (found != NULL && same_note_settings(*found, note))
     {
-      if (hasSavedNotes)
-      {
-        for (int i = 0; i < pianoGridWidth; i++)
-        {
-          for (int j = 0; j < pianoKeyCount; j++)
-          {
-            set_note(i, j, savedNotes[i][j]);
-          }
-        }
-        hasSavedNotes = false;
-      }
-      else
-      {
-        undoStack = stack<Action>(); // clear undo stack, since we dont know what was in the roll befor the clear
-      }
-      break;
+      NoteEvent before = *found;
+      remove_note(store, before);
+      note.start = before.start;
+      note.length += before.length;
     }
+    add_note(store, note);
   }
-  gtk_widget_queue_draw(GTK_WIDGET(data));  
 }
 
-static void redo(GtkWidget* widger, gpointer data)
+
+
+// the gtk thread never touches what data_callback reads. Instead it sends commands through a
+// single-producer/single-consumer ring, and the audio thread applies them at the start of each callback
+enum CommandType
 {
-  if (redoStack.empty())
+  SET_NOTES_COMMAND,     // notes = new snapshot of the song for the audio thread
+  SET_WAVEFORM_COMMAND,  // data1 = OscillatorType
+  SET_PLAYING_COMMAND,   // data1 = playing
+  SEEK_COMMAND,          // data1 = column to continue playing from
+  PREVIEW_NOTE_COMMAND,  // data1 = key, data2 = sounding, data3 = bus, value = pan
+  COMMAND_TYPE_COUNT
+};
+
+struct Command
+{
+  CommandType type;
+  int data1;
+  int data2;
+  int data3;
+  NoteStore* notes;
+  float value;
+};
+
+struct CommandQueue
+{
+  Command commands[COMMAND_QUEUE_SIZE];
+  std::atomic<unsigned int> head; // next command the audio thread reads (only the audio thread writes this)
+  std::atomic<unsigned int> tail; // end of the commands the audio thread is allowed to see (only the gtk thread writes this)
+  unsigned int pendingTail;       // end of the commands written so far, including an unpublished batch
+
+  // when the ring is full the gtk thread doesn't wait for room. Every command sets state that the next one of the
+  // same type replaces, so it only holds on to the newest of each type and moves them into the ring later
+  Command held[COMMAND_TYPE_COUNT];
+  unsigned int heldOrder[COMMAND_TYPE_COUNT]; // when each held command was pushed, 0 if there is none
+  unsigned int heldCount;
+  unsigned int nextHeldOrder;
+  unsigned int replacedCommands; // how many held commands were dropped for a newer one
+  guint retryTimer;
+};
+
+CommandQueue commandQueue;
+int commandBatchDepth = 0;
+bool notesChanged = false; // notes were edited since the audio thread was last sent a snapshot
+
+void send_notes();
+
+// makes every command pushed so far visible to the audio thread at once. While commands are held back the rest
+// of their batch waits with them, so the audio thread never applies half of one
+void publish_commands()
+{
+  if (commandQueue.heldCount == 0)
   {
-    return;
+    commandQueue.tail.store(commandQueue.pendingTail, std::memory_order_release);
   }
+}
 
-  Action a = redoStack.top();
-  redoStack.pop();
-  undoStack.push(a);
+unsigned int command_queue_space()
+{
+  return COMMAND_QUEUE_SIZE - (commandQueue.pendingTail - commandQueue.head.load(std::memory_order_acquire));
+}
 
-  // perform undo operation
-  switch (a.type)
+void write_command(const Command& c)
+{
+  commandQueue.commands[commandQueue.pendingTail & (COMMAND_QUEUE_SIZE - 1)] = c;
+  commandQueue.pendingTail++;
+}
+
+// moves the held commands into the ring in the order they were pushed, once there is room for all of them
+bool flush_held_commands()
+{
+  if (commandQueue.heldCount > command_queue_space())
   {
-    case TOGGLE_NOTE:
-    {
-      toggle_note(a.data1, a.data2);
-      break;
-    }
-    case ADD_NOTE:
-    {
-      set_note(a.data1, a.data2, true);
-      break;
-    }
-    case REMOVE_NOTE:
-    {
-      set_note(a.data1, a.data2, false);
-      break;
-    }
-    case CLEAR_NOTES:
+    return false;
+  }
+  while (commandQueue.heldCount > 0)
+  {
+    int oldest = -1;
+    for (int t = 0; t < COMMAND_TYPE_COUNT; t++)
     {
-      for (int i = 0; i < pianoGridWidth; i++)
+      if (commandQueue.heldOrder[t] != 0 && (oldest == -1 || commandQueue.heldOrder[t] < commandQueue.heldOrder[oldest]))
       {
-        for (int j = 0; j < pianoKeyCount; j++)
-        {
-          savedNotes[i][j] = get_note(i,j);
-          set_note(i, j, false);
-        }
+        oldest = t;
       }
-      hasSavedNotes = true;
     }
+    write_command(commandQueue.held[oldest]);
+    commandQueue.heldOrder[oldest] = 0;
+    commandQueue.heldCount--;
+  }
+  if (commandQueue.replacedCommands > 0)
+  {
+    g_print("the audio thread fell behind, %u commands were replaced by newer ones\n", commandQueue.replacedCommands);
+    commandQueue.replacedCommands = 0;
+  }
+  if (commandBatchDepth == 0)
+  {
+    publish_commands();
   }
-  gtk_widget_queue_draw(GTK_WIDGET(data));  
-}
-
-gboolean handle_undo_shortcut(GtkWidget* widget, GVariant* args, gpointer user_data)
-{
-  undo(widget, NULL);
   return true;
 }
 
-void init_notes()
+static gboolean retry_held_commands(gpointer data)
 {
-  notes = new bool*[pianoGridWidth];
-  savedNotes = new bool*[pianoGridWidth];
-  for (int i = 0; i < pianoGridWidth; i++)
+  if (!flush_held_commands())
   {
-    notes[i] = new bool[pianoKeyCount];
-    savedNotes[i] = new bool[pianoKeyCount];
-    for (int j = 0; j < pianoKeyCount; j++)
-    {
-      notes[i][j] = false;
-      savedNotes[i][j] = false;
-    }
+    return G_SOURCE_CONTINUE;
   }
+  commandQueue.retryTimer = 0;
+  return G_SOURCE_REMOVE;
 }
 
-void delete_notes()
+void hold_command(const Command& c)
 {
-  for (int i = 0; i < pianoGridWidth; i++)
+  if (commandQueue.heldOrder[c.type] != 0)
+  {
+    commandQueue.replacedCommands++;
+  }
+  else
+  {
+    commandQueue.heldCount++;
+  }
+  commandQueue.held[c.type] = c;
+  commandQueue.heldOrder[c.type] = ++commandQueue.nextHeldOrder;
+  if (commandQueue.retryTimer == 0)
   {
-    delete notes[i];
-    delete savedNotes[i];
+    commandQueue.retryTimer = g_timeout_add(COMMAND_RETRY_INTERVAL, retry_held_commands, NULL);
   }
-  delete notes;
-  delete savedNotes;
 }
 
+// commands pushed between begin/end of a batch are applied by the audio thread in the same callback,
+// so it never plays a half applied clear or undo
+void begin_command_batch()
+{
+  commandBatchDepth++;
+}
 
-
-static void clear_notes(GtkWidget* widget, gpointer data)
+void end_command_batch()
 {
-  for (int i = 0; i < pianoGridWidth; i++)
+  commandBatchDepth--;
+  if (commandBatchDepth == 0)
   {
-    for (int j = 0; j < pianoGridWidth; j++)
+    if (notesChanged)
     {
-      savedNotes[i][j] = get_note(i,j);
-      set_note(i, j, false);
+      send_notes();
     }
+    publish_commands();
   }
-  hasSavedNotes = true;
+}
 
-  Action clearAction;
-  clearAction.type = ActionType::CLEAR_NOTES;
-  undoStack.push(clearAction);
-  clear_redo_stack();
+// only called from the gtk thread
+void push_command(CommandType type, int data1 = 0, int data2 = 0, int data3 = 0, NoteStore* notes = NULL,
+                  float value = 0.0f)
+{
+  Command c = {type, data1, data2, data3, notes, value};
+  // once something is held everything after it is held too, or the audio thread would see it first
+  if (commandQueue.heldCount > 0 || command_queue_space() == 0)
+  {
+    hold_command(c);
+    flush_held_commands();
+    return;
+  }
+  write_command(c);
 
+  if (commandBatchDepth == 0)
+  {
+    publish_commands();
+  }
+}
 
-  gtk_widget_queue_draw(GTK_WIDGET(data));  
+// only called from the audio thread
+bool pop_command(Command* c)
+{
+  unsigned int head = commandQueue.head.load(std::memory_order_relaxed);
+  if (head == commandQueue.tail.load(std::memory_order_acquire))
+  {
+    return false;
+  }
+  *c = commandQueue.commands[head & (COMMAND_QUEUE_SIZE - 1)];
+  commandQueue.head.store(head + 1, std::memory_order_release);
+  return true;
 }
 
 
-double dragStartX = 0.0;
-double dragStartY = 0.0;
 
-static void piano_roll_primary_drag_begin(GtkGestureDrag *gesture,
-            double          x,
-            double          y,
-            GtkWidget      *area)
-{
-  // g_print("drag begin\n");
-  dragStartX = x;
-  dragStartY = y;
-  int width = gtk_widget_get_allocated_width(area);
-  int height = gtk_widget_get_allocated_height(area);
-  if (x >= pianoRollBorder && x < width - pianoRollBorder
-      && y >= pianoRollBorder && y < height - pianoRollBorder)
-  {
-    double keyWidth = (double) (width - 2 * pianoRollBorder) / pianoGridWidth;
-    double xd = (x - pianoRollBorder) / keyWidth;
-    double keyHeight = (double) (height - 2 * pianoRollBorder) / pianoKeyCount;
-    double yd = (height - y - pianoRollBorder) / keyHeight;
-    // g_printf("xd: %f, yd: %f\n", xd, yd);
-    toggle_note((int) xd, (int) yd);
+double scrubberPosition = 0.0; // the column the scrubber is at
+int scrubberWidth = 5;
+int scrubberHeightOffset = 20;
+double playbackTime = 0.0; // in seconds I think
+bool playing = false;
 
-    Action toggleAction;
-    toggleAction.type = ActionType::TOGGLE_NOTE;
-    toggleAction.data1 = (int) xd;
-    toggleAction.data2 = (int) yd;
-    undoStack.push(toggleAction);
-    clear_redo_stack();
+ma_device device;
+int liveOversampling = 1; // 1, 2 or 4 times the device rate the live synth renders at
 
-    editX = (int) xd;
-    editY = (int) yd;
-    editNoteSoundActive = true;
-    gtk_widget_queue_draw(area);
-  }
+// the rate the live synth and its sequencer clock run at
+ma_uint32 live_sample_rate()
+{
+  return device.sampleRate * liveOversampling;
 }
 
-static void piano_roll_primary_drag_update (GtkGestureClick *gesture,
-         double           x,
-         double           y,
+// the sequencer clock lives on the audio thread. After every callback it publishes which frame the buffer it just
+// rendered starts at and when that frame will come out of the speakers, and the ui works out from that where to
+// draw the scrubber, so a slow gtk frame never holds up the audio
+struct PlaybackSnapshot
+{
+  ma_uint64 frame;      // first frame of the last buffer rendered, at live_sample_rate
+  int column;           // the column playing at frame
+  gint64 heardTime;     // when frame will be heard, in g_get_monotonic_time microseconds
+  ma_uint32 frameCount; // frames in that buffer
+  ma_uint64 startFrame; // where playback last started or was moved to, nothing before it is coming out
+  bool playing;
+  ma_uint64 endFrame;   // where the song last played to its end
+  gint64 endHeardTime;  // and when that end is heard
+};
+
+// a seqlock: the audio thread makes sequence odd while it writes, and a reader that sees it odd or changed by the
+// time it is done reads again. The audio thread never waits on the ui
+struct PublishedPlayback
+{
+  std::atomic<ma_uint32> sequence;
+  std::atomic<ma_uint64> frame;
+  std::atomic<int> column;
+  std::atomic<gint64> heardTime;
+  std::atomic<ma_uint32> frameCount;
+  std::atomic<ma_uint64> startFrame;
+  std::atomic<bool> playing;
+  std::atomic<ma_uint64> endFrame;
+  std::atomic<gint64> endHeardTime;
+};
+
+PublishedPlayback publishedPlayback;
+
+// audio thread only
+void publish_playback(const PlaybackSnapshot& snapshot)
+{
+  ma_uint32 sequence = publishedPlayback.sequence.load(std::memory_order_relaxed);
+  publishedPlayback.sequence.store(sequence + 1, std::memory_order_relaxed);
+  std::atomic_thread_fence(std::memory_order_release);
+  publishedPlayback.frame.store(snapshot.frame, std::memory_order_relaxed);
+  publishedPlayback.column.store(snapshot.column, std::memory_order_relaxed);
+  publishedPlayback.heardTime.store(snapshot.heardTime, std::memory_order_relaxed);
+  publishedPlayback.frameCount.store(snapshot.frameCount, std::memory_order_relaxed);
+  publishedPlayback.startFrame.store(snapshot.startFrame, std::memory_order_relaxed);
+  publishedPlayback.playing.store(snapshot.playing, std::memory_order_relaxed);
+  publishedPlayback.endFrame.store(snapshot.endFrame, std::memory_order_relaxed);
+  publishedPlayback.endHeardTime.store(snapshot.endHeardTime, std::memory_order_relaxed);
+  publishedPlayback.sequence.store(sequence + 2, std::memory_order_release);
+}
+
+PlaybackSnapshot read_playback()
+{
+  PlaybackSnapshot snapshot;
+  while (true)
+  {
+    ma_uint32 sequence = publishedPlayback.sequence.load(std::memory_order_acquire);
+    snapshot.frame = publishedPlayback.frame.load(std::memory_order_relaxed);
+    snapshot.column = publishedPlayback.column.load(std::memory_order_relaxed);
+    snapshot.heardTime = publishedPlayback.heardTime.load(std::memory_order_relaxed);
+    snapshot.frameCount = publishedPlayback.frameCount.load(std::memory_order_relaxed);
+    snapshot.startFrame = publishedPlayback.startFrame.load(std::memory_order_relaxed);
+    snapshot.playing = publishedPlayback.playing.load(std::memory_order_relaxed);
+    snapshot.endFrame = publishedPlayback.endFrame.load(std::memory_order_relaxed);
+    snapshot.endHeardTime = publishedPlayback.endHeardTime.load(std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_acquire);
+    if (sequence % 2 == 0 && publishedPlayback.sequence.load(std::memory_order_relaxed) == sequence)
+    {
+      return snapshot;
+    }
+  }
+}
+
+std::atomic<unsigned int> playbackEndCount(0); // bumped by the audio thread every time the song plays to the end
+unsigned int seenPlaybackEndCount = 0;
+
+static void start_playback(GtkWidget* widget, gpointer data)
+{
+  playing = true;  
+  g_print("now playing!\n");
+  seenPlaybackEndCount = playbackEndCount.load(std::memory_order_acquire);
+  push_command(SET_PLAYING_COMMAND, true);
+}
+
+static void stop_playback(GtkWidget* widget, gpointer data)
+{
+  playing = false;  
+  push_command(SET_PLAYING_COMMAND, false);
+  g_print("stopped playing\n");
+  gtk_widget_queue_draw(GTK_WIDGET(data));  
+}
+
+static void reset_playback(GtkWidget* widget, gpointer data)
+{
+  playing = false;
+  begin_command_batch();
+  push_command(SET_PLAYING_COMMAND, false);
+  push_command(SEEK_COMMAND, 0);
+  end_command_batch();
+  playbackTime = 0.0;
+  scrubberPosition = 0.0;
+  gtk_widget_queue_draw(GTK_WIDGET(data));  
+  g_print("reset\n");
+}
+
+static void edit_note(GtkWidget* widget)
+{
+  
+}
+
+// the audio thread plays from its own snapshot of notes. Every edit sends it a fresh copy, which shares every bucket
+// the edit didn't change with the ones before it. A snapshot is only
+// deleted by the gtk thread once the audio thread has moved on to a newer one, so nothing is freed under its feet
+NoteStore* audioNotes;
+std::atomic<NoteStore*> audioNotesInUse(NULL); // written by the audio thread after it switches snapshots
+deque<NoteStore*> sentNotes; // every snapshot that might still be in use, oldest first
+
+void reclaim_sent_notes()
+{
+  NoteStore* inUse = audioNotesInUse.load(std::memory_order_acquire);
+  while (sentNotes.size() > 1 && sentNotes.front() != inUse)
+  {
+    delete sentNotes.front();
+    sentNotes.pop_front();
+  }
+}
+
+void send_notes()
+{
+  notesChanged = false;
+  reclaim_sent_notes();
+  NoteStore* snapshot = new NoteStore(notes);
+  sentNotes.push_back(snapshot);
+  push_command(SET_NOTES_COMMAND, 0, 0, 0, snapshot);
+}
+
+// call after every edit of notes
+void notes_changed()
+{
+  notesChanged = true;
+  if (commandBatchDepth == 0)
+  {
+    send_notes();
+  }
+}
+
+bool get_note(int x, int y)
+{
+  return find_note(&notes, x, y) != NULL;
+}
+
+// the part of the roll that is on screen. The grid is scrolled so that column viewColumn and key viewKey are at its
+// bottom left corner, and zoomed so columns are columnWidth pixels wide. Keys share the height of the roll unless
+// that would make them shorter than PIANO_ROLL_MIN_KEY_HEIGHT
+double viewColumn = 0.0;
+double viewKey = 0.0;
+double columnWidth = PIANO_ROLL_COLUMN_WIDTH;
+
+// how cells map to pixels in a roll of a given size. Drawing, damage and the hit-test all go through this
+struct RollView
+{
+  double left;   // edges of the grid area of the widget
+  double right;
+  double top;
+  double bottom;
+  double column; // column and key at the bottom left corner of the grid area
+  double key;
+  double columnWidth;
+  double keyHeight;
+};
+
+RollView piano_roll_view(int width, int height)
+{
+  RollView view;
+  view.left = pianoRollBorder;
+  view.right = std::max(width - pianoRollBorder, pianoRollBorder);
+  view.top = pianoRollBorder;
+  view.bottom = std::max(height - pianoRollBorder, pianoRollBorder);
+  view.columnWidth = columnWidth;
+  view.keyHeight = std::max((view.bottom - view.top) / pianoKeyCount, PIANO_ROLL_MIN_KEY_HEIGHT);
+  // scrolled by whole pixels, so the cached tiles line up with the screen pixels
+  view.column = std::round(viewColumn * view.columnWidth) / view.columnWidth;
+  view.key = pianoKeyCount - std::round((pianoKeyCount - viewKey) * view.keyHeight) / view.keyHeight;
+  return view;
+}
+
+double view_x(const RollView& view, double column)
+{
+  return view.left + (column - view.column) * view.columnWidth;
+}
+
+double view_y(const RollView& view, double key)
+{
+  return view.bottom - (key - view.key) * view.keyHeight;
+}
+
+double view_column(const RollView& view, double x)
+{
+  return view.column + (x - view.left) / view.columnWidth;
+}
+
+double view_key(const RollView& view, double y)
+{
+  return view.key + (view.bottom - y) / view.keyHeight;
+}
+
+// the columns from *first up to *last (not including it) that are at least partly between x0 and x1 on screen
+void columns_between(const RollView& view, double x0, double x1, int* first, int* last)
+{
+  *first = std::max((int) std::floor(view_column(view, std::max(x0, view.left))), 0);
+  *last = std::min((int) std::ceil(view_column(view, std::min(x1, view.right))), pianoGridWidth);
+}
+
+// the same for keys between y0 and y1 (y0 above y1)
+void keys_between(const RollView& view, double y0, double y1, int* first, int* last)
+{
+  *first = std::max((int) std::floor(view_key(view, std::min(y1, view.bottom))), 0);
+  *last = std::min((int) std::ceil(view_key(view, std::max(y0, view.top))), pianoKeyCount);
+}
+
+// the roll is drawn from a cache of tiles, each PIANO_ROLL_TILE_SIZE pixels square and holding the lanes, notes and
+// grid lines of one part of the song at one zoom. A frame blits the tiles in view and only draws the ones that
+// aren't cached yet, so scrolling mostly costs blits however long the song is. Editing notes throws away just the
+// tiles over the changed cells (at every zoom), and the least recently used tiles go once there are too many
+struct RollTile
+{
+  cairo_surface_t* surface;
+  double columnWidth; // the zoom it was drawn at
+  double keyHeight;
+  int x;              // which tile it is, along and down the roll at that zoom
+  int y;
+  int firstColumn;    // the cells it shows, from the first ones up to (not including) the last ones
+  int lastColumn;
+  int firstKey;
+  int lastKey;
+  ma_uint64 lastUsed; // frame it was last blitted in
+};
+
+struct PianoRollCache
+{
+  vector<RollTile> tiles;
+  ma_uint64 frame;
+  // the tiles are thrown away when any of these change
+  int scale; // the widget's scale factor, tiles are drawn at that many pixels to a widget pixel
+  int keyCount;
+  int gridWidth;
+};
+
+PianoRollCache pianoRollCache = {};
+
+// throws away the tiles showing any of the cells from column x0 to x1 and key y0 to y1, to be drawn again when next
+// in view
+void damage_piano_roll_cells(int x0, int x1, int y0, int y1)
+{
+  vector<RollTile>& tiles = pianoRollCache.tiles;
+  for (size_t i = 0; i < tiles.size();)
+  {
+    RollTile& tile = tiles[i];
+    if (tile.firstColumn <= x1 && x0 < tile.lastColumn && tile.firstKey <= y1 && y0 < tile.lastKey)
+    {
+      cairo_surface_destroy(tile.surface);
+      tile = tiles.back();
+      tiles.pop_back();
+    }
+    else
+    {
+      i++;
+    }
+  }
+}
+
+// throws away every tile, for edits that touch more than a few cells
+void damage_piano_roll()
+{
+  for (RollTile& tile : pianoRollCache.tiles)
+  {
+    cairo_surface_destroy(tile.surface);
+  }
+  pianoRollCache.tiles.clear();
+}
+
+// the track and pan of notes drawn into the roll
+int editBus = 0;
+float editPan = 0.0f;
+
+void set_note(int x, int y, bool value, int bus, float pan)
+{
+  if (x < 0 || x >= pianoGridWidth || y < 0 || y >= pianoKeyCount)
+  {
+    return;
+  }
+  if (get_note(x, y) != value)
+  {
+    set_store_note(&notes, x, y, value, 1.0f, pan, bus);
+    notes_changed();
+    damage_piano_roll_cells(x, x, y, y);
+  }
+}
+
+void toggle_note(int x, int y, int bus, float pan)
+{
+  set_note(x, y, !get_note(x, y), bus, pan);
+  // g_print("note toggled\n");
+}
+
+enum ActionType
+{
+  TOGGLE_NOTE,
+  ADD_NOTE,
+  REMOVE_NOTE,
+  CLEAR_NOTES
+};
+
+struct Action
+{
+  ActionType type;
+  int data1;
+  int data2;
+  int bus;   // what a note the action turns back on plays with
+  float pan;
+};
+
+// toggling a cell turns a note off along with its track and pan, or on with the ones new notes get,
+// so undoing it puts back exactly what was there
+Action toggle_action(int x, int y)
+{
+  Action a;
+  a.type = TOGGLE_NOTE;
+  a.data1 = x;
+  a.data2 = y;
+  a.bus = editBus;
+  a.pan = editPan;
+  const NoteEvent* e = find_note(&notes, x, y);
+  if (e != NULL)
+  {
+    a.bus = e->bus;
+    a.pan = e->pan;
+  }
+  return a;
+}
+
+
+
+stack<Action> undoStack;
+stack<Action> redoStack;
+bool hasSavedNotes = false;
+vector<NoteEvent> savedNotes; // allows for ONE undo of a clear action
+
+static void clear_redo_stack()
+{
+  redoStack = stack<Action>();
+}
+
+// saves the roll for undo, then empties it
+static void clear_all_notes()
+{
+  savedNotes = get_store_notes(&notes);
+  set_store_notes(&notes, vector<NoteEvent>());
+  notes_changed();
+  damage_piano_roll();
+  hasSavedNotes = true;
+}
+
+static void undo(GtkWidget* widget, gpointer data)
+{
+  if (undoStack.empty())
+  {
+    return;
+  }
+
+  Action a = undoStack.top();
+  undoStack.pop();
+  redoStack.push(a);
+
+  // perform undo operation
+  begin_command_batch();
+  switch (a.type)
+  {
+    case TOGGLE_NOTE:
+    {
+      toggle_note(a.data1, a.data2, a.bus, a.pan);
+      break;
+    }
+    case ADD_NOTE:
+    {
+      set_note(a.data1, a.data2, false, a.bus, a.pan);
+      break;
+    }
+    case REMOVE_NOTE:
+    {
+      set_note(a.data1, a.data2, true, a.bus, a.pan);
+      break;
+    }
+    case CLEAR_NOTES:
+    {
+      if (hasSavedNotes)
+      {
+        set_store_notes(&notes, savedNotes);
+        savedNotes.clear();
+        notes_changed();
+        damage_piano_roll();
+        hasSavedNotes = false;
+      }
+      else
+      {
+        undoStack = stack<Action>(); // clear undo stack, since we dont know what was in the roll befor the clear
+      }
+      break;
+    }
+  }
+  end_command_batch();
+  gtk_widget_queue_draw(GTK_WIDGET(data));  
+}
+
+static void redo(GtkWidget* widger, gpointer data)
+{
+  if (redoStack.empty())
+  {
+    return;
+  }
+
+  Action a = redoStack.top();
+  redoStack.pop();
+  undoStack.push(a);
+
+  // perform undo operation
+  begin_command_batch();
+  switch (a.type)
+  {
+    case TOGGLE_NOTE:
+    {
+      toggle_note(a.data1, a.data2, a.bus, a.pan);
+      break;
+    }
+    case ADD_NOTE:
+    {
+      set_note(a.data1, a.data2, true, a.bus, a.pan);
+      break;
+    }
+    case REMOVE_NOTE:
+    {
+      set_note(a.data1, a.data2, false, a.bus, a.pan);
+      break;
+    }
+    case CLEAR_NOTES:
+    {
+      clear_all_notes();
+    }
+  }
+  end_command_batch();
+  gtk_widget_queue_draw(GTK_WIDGET(data));  
+}
+
+gboolean handle_undo_shortcut(GtkWidget* widget, GVariant* args, gpointer user_data)
+{
+  undo(widget, NULL);
+  return true;
+}
+
+void init_notes()
+{
+  if (pianoKeyCount > MAX_PIANO_KEYS)
+  {
+    g_print("only %i keys fit in a KeyMask\n", MAX_PIANO_KEYS);
+    pianoKeyCount = MAX_PIANO_KEYS;
+  }
+  audioNotes = new NoteStore(notes);
+  sentNotes.push_back(audioNotes);
+  audioNotesInUse.store(audioNotes);
+}
+
+// only once the audio thread is stopped
+void delete_notes()
+{
+  for (NoteStore* snapshot : sentNotes)
+  {
+    delete snapshot;
+  }
+  sentNotes.clear();
+  audioNotes = NULL;
+}
+
+
+
+static void clear_notes(GtkWidget* widget, gpointer data)
+{
+  clear_all_notes();
+
+  Action clearAction;
+  clearAction.type = ActionType::CLEAR_NOTES;
+  undoStack.push(clearAction);
+  clear_redo_stack();
+
+
+  gtk_widget_queue_draw(GTK_WIDGET(data));  
+}
+
+
+double dragStartX = 0.0;
+double dragStartY = 0.0;
+
+static void piano_roll_primary_drag_begin(GtkGestureDrag *gesture,
+            double          x,
+            double          y,
+            GtkWidget      *area)
+{
+  // g_print("drag begin\n");
+  dragStartX = x;
+  dragStartY = y;
+  RollView view = piano_roll_view(gtk_widget_get_allocated_width(area), gtk_widget_get_allocated_height(area));
+  double xd = view_column(view, x);
+  double yd = view_key(view, y);
+  if (x >= view.left && x < view.right && y >= view.top && y < view.bottom
+      && xd < pianoGridWidth && yd < pianoKeyCount)
+  {
+    // g_printf("xd: %f, yd: %f\n", xd, yd);
+    Action toggleAction = toggle_action((int) xd, (int) yd);
+    toggle_note(toggleAction.data1, toggleAction.data2, toggleAction.bus, toggleAction.pan);
+    undoStack.push(toggleAction);
+    clear_redo_stack();
+
+    editX = (int) xd;
+    editY = (int) yd;
+    editNoteSoundActive = true;
+    push_command(PREVIEW_NOTE_COMMAND, editY, true, editBus, NULL, editPan);
+    gtk_widget_queue_draw(area);
+  }
+}
+
+static void piano_roll_primary_drag_update (GtkGestureClick *gesture,
+         double           x,
+         double           y,
          GtkWidget       *area)
 {
-  // g_print("drag update\n");
-  x += dragStartX;
-  y += dragStartY;
-  int width = gtk_widget_get_allocated_width(area);
-  int height = gtk_widget_get_allocated_height(area);
-  if (x >= pianoRollBorder && x < width - pianoRollBorder
-      && y >= pianoRollBorder && y < height - pianoRollBorder)
+  // g_print("drag update\n");
+  x += dragStartX;
+  y += dragStartY;
+  RollView view = piano_roll_view(gtk_widget_get_allocated_width(area), gtk_widget_get_allocated_height(area));
+  double xd = view_column(view, x);
+  double yd = view_key(view, y);
+  if (x >= view.left && x < view.right && y >= view.top && y < view.bottom
+      && xd < pianoGridWidth && yd < pianoKeyCount)
+  {
+    if ((int) xd != editX || (int) yd != editY )
+    {
+      // g_printf("xd: %f, yd: %f\n", xd, yd);
+      editX = (int) xd;
+      editY = (int) yd;
+      push_command(PREVIEW_NOTE_COMMAND, editY, editNoteSoundActive, editBus, NULL, editPan);
+      Action toggleAction = toggle_action((int) xd, (int) yd);
+      toggle_note(toggleAction.data1, toggleAction.data2, toggleAction.bus, toggleAction.pan);
+      undoStack.push(toggleAction);
+      clear_redo_stack();
+
+      gtk_widget_queue_draw(area);
+    }
+  }
+}
+
+static void piano_roll_primary_drag_end (GtkGestureClick *gesture,
+         double           x,
+         double           y,
+         GtkWidget       *area)
+{
+  // g_print("drag end\n");
+  editNoteSoundActive = false;
+  push_command(PREVIEW_NOTE_COMMAND, editY, false);
+}
+
+// the scrollbars' adjustments hold the view. The key one counts down from the top key, like the scrollbar does
+GtkAdjustment* columnAdjustment = NULL;
+GtkAdjustment* keyAdjustment = NULL;
+
+void view_from_adjustments()
+{
+  viewColumn = gtk_adjustment_get_value(columnAdjustment);
+  viewKey = std::max(gtk_adjustment_get_upper(keyAdjustment) - gtk_adjustment_get_page_size(keyAdjustment)
+                     - gtk_adjustment_get_value(keyAdjustment), 0.0);
+}
+
+// fits the scrollbars to the song, the zoom and the size of the roll
+void update_view_adjustments(int width, int height)
+{
+  if (columnAdjustment == NULL)
+  {
+    return;
+  }
+  RollView view = piano_roll_view(width, height);
+  double columns = (view.right - view.left) / view.columnWidth;
+  double keys = (view.bottom - view.top) / view.keyHeight;
+  gtk_adjustment_configure(columnAdjustment, viewColumn, 0, pianoGridWidth, 1, std::max(columns - 1, 1.0), columns);
+  gtk_adjustment_configure(keyAdjustment, pianoKeyCount - keys - viewKey, 0, pianoKeyCount, 1, std::max(keys - 1, 1.0),
+                           keys);
+  view_from_adjustments();
+}
+
+static void scroll_piano_roll_view(GtkAdjustment* adjustment, gpointer data)
+{
+  view_from_adjustments();
+  gtk_widget_queue_draw(GTK_WIDGET(data));
+}
+
+static void resize_piano_roll(GtkDrawingArea* area, int width, int height, gpointer data)
+{
+  update_view_adjustments(width, height);
+}
+
+// the wheel scrolls the roll (sideways with shift held), and zooms it around its middle with ctrl held
+static gboolean scroll_piano_roll(GtkEventControllerScroll* controller, double dx, double dy, gpointer data)
+{
+  GtkWidget* area = GTK_WIDGET(data);
+  int width = gtk_widget_get_allocated_width(area);
+  int height = gtk_widget_get_allocated_height(area);
+  GdkModifierType state = gtk_event_controller_get_current_event_state(GTK_EVENT_CONTROLLER(controller));
+  if (state & GDK_CONTROL_MASK)
+  {
+    RollView view = piano_roll_view(width, height);
+    double middle = view_column(view, (view.left + view.right) / 2);
+    columnWidth = std::min(std::max(columnWidth * std::pow(PIANO_ROLL_ZOOM_STEP, -dy), PIANO_ROLL_MIN_COLUMN_WIDTH),
+                           PIANO_ROLL_MAX_COLUMN_WIDTH);
+    viewColumn = std::max(middle - (view.right - view.left) / 2 / columnWidth, 0.0);
+    update_view_adjustments(width, height);
+    gtk_widget_queue_draw(area);
+    return TRUE;
+  }
+  if (state & GDK_SHIFT_MASK)
+  {
+    dx += dy;
+    dy = 0;
+  }
+  gtk_adjustment_set_value(columnAdjustment, gtk_adjustment_get_value(columnAdjustment) + dx * PIANO_ROLL_SCROLL_STEP);
+  gtk_adjustment_set_value(keyAdjustment, gtk_adjustment_get_value(keyAdjustment) + dy * PIANO_ROLL_SCROLL_STEP);
+  return TRUE;
+}
+
+// when the frame being drawn now will actually show up on screen
+gint64 predicted_presentation_time(GdkFrameClock* frame_clock)
+{
+  GdkFrameTimings* timings = gdk_frame_clock_get_current_timings(frame_clock);
+  gint64 presentation = timings != NULL ? gdk_frame_timings_get_predicted_presentation_time(timings) : 0;
+  return presentation != 0 ? presentation : gdk_frame_clock_get_frame_time(frame_clock);
+}
+
+static gboolean animate_piano_roll(GtkWidget* widget, GdkFrameClock* frame_clock, gpointer user_data)
+{
+  // g_print("animation called\n");
+  if (!playing)
+  {
+    return true;
+  }
+
+  // g_print("animating...\n");
+
+  // the audio thread owns the clock, we only follow it: its last snapshot says which frame is heard when,
+  // so carry it on to when this frame is presented. never run more than a couple of buffers past it in
+  // case the audio thread stalls, and never back before where playback started
+  PlaybackSnapshot snapshot = read_playback();
+  gint64 presentation = predicted_presentation_time(frame_clock);
+  double frame = (double) snapshot.frame;
+  if (playbackEndCount.load(std::memory_order_acquire) != seenPlaybackEndCount && !snapshot.playing)
+  {
+    // the audio thread played to the end of the song, but the last of it is still on its way to the speakers.
+    // the scrubber runs on to the end and only goes back to the start once the end is heard
+    if (presentation >= snapshot.endHeardTime)
+    {
+      reset_playback(NULL, widget);
+      return true;
+    }
+    frame = std::max(snapshot.endFrame - (snapshot.endHeardTime - presentation) * 1e-6 * live_sample_rate(), 0.0);
+  }
+  else if (snapshot.playing)
+  {
+    double elapsed = (presentation - snapshot.heardTime) * 1e-6 * live_sample_rate();
+    frame = std::max(frame + std::min(elapsed, 2.0 * snapshot.frameCount), (double) snapshot.startFrame);
+  }
+  playbackTime = frame / live_sample_rate();
+  // g_printf("playback time: %f\n", playbackTime);
+
+  // update scrubber
+
+  RollView view = piano_roll_view(gtk_widget_get_allocated_width(widget), gtk_widget_get_allocated_height(widget));
+  double position = playbackTime * tempo;
+
+  // the view turns a page when the scrubber runs off it
+  if (columnAdjustment != NULL && (position < view.column || view_x(view, position) >= view.right))
+  {
+    gtk_adjustment_set_value(columnAdjustment, std::floor(position));
+  }
+
+  // the roll itself is cached, so a frame is only worth drawing if the scrubber moved to another pixel
+  if (std::round(view_x(view, position)) != std::round(view_x(view, scrubberPosition)))
+  {
+    // g_print("queueing redraw\n");
+    gtk_widget_queue_draw(widget);
+  }
+  scrubberPosition = position;
+    
+
+  return true; // I guess?
+}
+
+GdkRGBA whiteKeyColor = {0.8, 0.8, 0.8, 1.0};
+GdkRGBA blackKeyColor = {0.5, 0.5, 0.5, 1.0};
+GdkRGBA gridLineColor = {0.0, 0.0, 0.0, 1.0};
+GdkRGBA noteColor = {0.0, 0.0, 0.0, 1.0};
+GdkRGBA scrubberColor = {1.0, 0.0, 0.0, 1.0};
+
+// everything of one colour goes into one path and is filled or stroked once, so cairo rasterizes each colour
+// in a single pass instead of once per lane, note or line
+void draw_piano_roll_lanes(cairo_t* cr, const RollView& view)
+{
+  bool keyColors[] = {1, 0, 1, 0, 1, 1, 0, 1, 0, 1, 0, 1};
+  int firstKey, lastKey;
+  keys_between(view, view.top, view.bottom, &firstKey, &lastKey);
+  double left = std::max(view.left, view_x(view, 0));
+  double right = std::min(view.right, view_x(view, pianoGridWidth));
+
+  for (int white = 1; white >= 0; white--)
+  {
+    for (int k = firstKey; k < lastKey; k++)
+    {
+      if (keyColors[k % 12] == white)
+      {
+        cairo_rectangle (cr, left, view_y(view, k + 1), right - left, view.keyHeight);
+      }
+    }
+    gdk_cairo_set_source_rgba(cr, white ? &whiteKeyColor : &blackKeyColor);
+    cairo_fill (cr);
+  }
+}
+
+void draw_piano_roll_grid(cairo_t* cr, const RollView& view)
+{
+  int firstColumn, lastColumn, firstKey, lastKey;
+  columns_between(view, view.left, view.right, &firstColumn, &lastColumn);
+  keys_between(view, view.top, view.bottom, &firstKey, &lastKey);
+  double left = std::max(view.left, view_x(view, 0));
+  double right = std::min(view.right, view_x(view, pianoGridWidth));
+  double top = std::max(view.top, view_y(view, pianoKeyCount));
+  double bottom = std::min(view.bottom, view_y(view, 0));
+  double gridLineWidth = 2.0;
+  cairo_set_line_width(cr, gridLineWidth);  
+  gdk_cairo_set_source_rgba(cr, &gridLineColor);
+
+  // horizontal
+  for (int k = std::max(firstKey, 1); k <= std::min(lastKey, pianoKeyCount - 1); k++)
+  {
+    cairo_move_to(cr, left, view_y(view, k));
+    cairo_line_to(cr, right, view_y(view, k));
+  }
+
+  // vertical
+  for (int j = std::max(firstColumn, 1); j <= std::min(lastColumn, pianoGridWidth - 1); j++)
+  {
+    cairo_move_to(cr, view_x(view, j), top);
+    cairo_line_to(cr, view_x(view, j), bottom);
+  }
+  cairo_stroke(cr);
+}
+
+// fills the notes in view. Each column is fetched as a KeyMask, and every run of keys that are on in it becomes one
+// rectangle of the path
+void draw_piano_roll_notes(cairo_t* cr, const RollView& view)
+{
+  int firstColumn, lastColumn, firstKey, lastKey;
+  columns_between(view, view.left, view.right, &firstColumn, &lastColumn);
+  keys_between(view, view.top, view.bottom, &firstKey, &lastKey);
+
+  for (int column = firstColumn; column < lastColumn; column++)
+  {
+    KeyMask mask = get_column_mask(&notes, column);
+    int runStart = next_key_in_mask(mask, firstKey, true);
+    while (runStart < lastKey)
+    {
+      int runEnd = std::min(next_key_in_mask(mask, runStart, false), lastKey);
+      cairo_rectangle(cr,
+                      view_x(view, column),
+                      view_y(view, runEnd),
+                      view.columnWidth,
+                      (runEnd - runStart) * view.keyHeight);
+      runStart = next_key_in_mask(mask, runEnd, true);
+    }
+  }
+  gdk_cairo_set_source_rgba(cr, &noteColor);
+  cairo_fill(cr);
+}
+
+// nothing is drawn over the border around the grid
+void clip_to_piano_roll_grid(cairo_t* cr, const RollView& view)
+{
+  cairo_rectangle(cr, view.left, view.top, view.right - view.left, view.bottom - view.top);
+  cairo_clip(cr);
+}
+
+// tile x, y as a view of its own, with the top left corner of the song at the top left corner of tile 0, 0
+RollView roll_tile_view(double columnWidth, double keyHeight, int x, int y)
+{
+  RollView view;
+  view.left = 0;
+  view.right = PIANO_ROLL_TILE_SIZE;
+  view.top = 0;
+  view.bottom = PIANO_ROLL_TILE_SIZE;
+  view.columnWidth = columnWidth;
+  view.keyHeight = keyHeight;
+  view.column = (double) x * PIANO_ROLL_TILE_SIZE / columnWidth;
+  view.key = pianoKeyCount - (double) (y + 1) * PIANO_ROLL_TILE_SIZE / keyHeight;
+  return view;
+}
+
+// a surface for the cache to draw into, width by height in widget pixels. It has to be an image surface:
+// gtk4 hands the draw function a recording surface, and a surface made similar to that only records the drawing
+// and plays it all back on every blit (and keeps growing as it is drawn over), so nothing would be cached
+cairo_surface_t* create_piano_roll_surface(int width, int height, int scale)
+{
+  cairo_surface_t* surface = cairo_image_surface_create(CAIRO_FORMAT_ARGB32, width * scale, height * scale);
+  cairo_surface_set_device_scale(surface, scale, scale);
+  return surface;
+}
+
+// the cached tile x, y at the zoom of view, which gets drawn if it isn't cached. The pointer is only good until
+// the next call
+RollTile* get_roll_tile(const RollView& view, int x, int y)
+{
+  PianoRollCache* cache = &pianoRollCache;
+  RollTile* leastUsed = NULL;
+  for (RollTile& tile : cache->tiles)
+  {
+    if (tile.x == x && tile.y == y && tile.columnWidth == view.columnWidth && tile.keyHeight == view.keyHeight)
+    {
+      tile.lastUsed = cache->frame;
+      return &tile;
+    }
+    if (tile.lastUsed != cache->frame && (leastUsed == NULL || tile.lastUsed < leastUsed->lastUsed))
+    {
+      leastUsed = &tile;
+    }
+  }
+
+  // make room, but never by dropping a tile this frame already blitted
+  if (cache->tiles.size() >= PIANO_ROLL_MAX_TILES && leastUsed != NULL)
+  {
+    cairo_surface_destroy(leastUsed->surface);
+    *leastUsed = cache->tiles.back();
+    cache->tiles.pop_back();
+  }
+
+  RollTile tile;
+  tile.surface = create_piano_roll_surface(PIANO_ROLL_TILE_SIZE, PIANO_ROLL_TILE_SIZE, cache->scale);
+  tile.columnWidth = view.columnWidth;
+  tile.keyHeight = view.keyHeight;
+  tile.x = x;
+  tile.y = y;
+  tile.lastUsed = cache->frame;
+  RollView tileView = roll_tile_view(view.columnWidth, view.keyHeight, x, y);
+  columns_between(tileView, tileView.left, tileView.right, &tile.firstColumn, &tile.lastColumn);
+  keys_between(tileView, tileView.top, tileView.bottom, &tile.firstKey, &tile.lastKey);
+
+  // lanes, then notes, then grid lines over them
+  cairo_t* tileCr = cairo_create(tile.surface);
+  draw_piano_roll_lanes(tileCr, tileView);
+  draw_piano_roll_notes(tileCr, tileView);
+  draw_piano_roll_grid(tileCr, tileView);
+  cairo_destroy(tileCr);
+
+  cache->tiles.push_back(tile);
+  return &cache->tiles.back();
+}
+
+// blits the tiles in view, drawing the ones that aren't cached. gtk4 doesn't say the scale through cr (its target
+// always has a device scale of 1), so it comes from the widget
+void draw_piano_roll_tiles(cairo_t* cr, const RollView& view, int scale)
+{
+  PianoRollCache* cache = &pianoRollCache;
+  if (cache->scale != scale || cache->keyCount != pianoKeyCount || cache->gridWidth != pianoGridWidth)
+  {
+    damage_piano_roll();
+    cache->scale = scale;
+    cache->keyCount = pianoKeyCount;
+    cache->gridWidth = pianoGridWidth;
+  }
+  cache->frame++;
+
+  // the top left corner of the song on screen, always on a whole pixel
+  double songX = view_x(view, 0);
+  double songY = view_y(view, pianoKeyCount);
+  int firstX = std::max((int) std::floor((view.left - songX) / PIANO_ROLL_TILE_SIZE), 0);
+  int lastX = std::min((int) std::ceil((view.right - songX) / PIANO_ROLL_TILE_SIZE),
+                       (int) std::ceil(pianoGridWidth * view.columnWidth / PIANO_ROLL_TILE_SIZE));
+  int firstY = std::max((int) std::floor((view.top - songY) / PIANO_ROLL_TILE_SIZE), 0);
+  int lastY = std::min((int) std::ceil((view.bottom - songY) / PIANO_ROLL_TILE_SIZE),
+                       (int) std::ceil(pianoKeyCount * view.keyHeight / PIANO_ROLL_TILE_SIZE));
+
+  cairo_save(cr);
+  clip_to_piano_roll_grid(cr, view);
+  for (int y = firstY; y < lastY; y++)
+  {
+    for (int x = firstX; x < lastX; x++)
+    {
+      RollTile* tile = get_roll_tile(view, x, y);
+      double tileX = songX + x * PIANO_ROLL_TILE_SIZE;
+      double tileY = songY + y * PIANO_ROLL_TILE_SIZE;
+      cairo_set_source_surface(cr, tile->surface, tileX, tileY);
+      cairo_rectangle(cr, tileX, tileY, PIANO_ROLL_TILE_SIZE, PIANO_ROLL_TILE_SIZE);
+      cairo_fill(cr);
+    }
+  }
+  cairo_restore(cr);
+}
+
+// the roll and the scrubber, width by height widget pixels at scale device pixels each
+void draw_piano_roll_frame(cairo_t* cr, int width, int height, int scale)
+{
+  // https://cairographics.org/manual/cairo-cairo-t.html
+
+  RollView view = piano_roll_view(width, height);
+  draw_piano_roll_tiles(cr, view, scale);
+
+  // draw playback scrubber, if it is in view
+  double scrubberX = view_x(view, scrubberPosition);
+  if (scrubberX >= view.left && scrubberX <= view.right)
+  {
+    cairo_set_line_width(cr, scrubberWidth);
+    gdk_cairo_set_source_rgba(cr, &scrubberColor);
+    cairo_move_to(cr, scrubberX, view.top - scrubberHeightOffset);
+    cairo_line_to(cr, scrubberX, view.bottom + scrubberHeightOffset);
+    cairo_stroke(cr);
+  }
+}
+
+static void draw_piano_roll(GtkDrawingArea *area,
+               cairo_t        *cr,
+               int             width,
+               int             height,
+               gpointer        data)
+{
+  draw_piano_roll_frame(cr, width, height, gtk_widget_get_scale_factor(GTK_WIDGET(area)));
+}
+
+// the oscillators are plain phase accumulators (phase counts cycles, from 0 up to 1) with a kernel per waveform
+// and instruction set. Each kernel adds its samples straight into the output with a linear gain ramp
+// (in the same order as the instrument drop down)
+enum OscillatorType
+{
+  SINE_OSCILLATOR,
+  SQUARE_OSCILLATOR,
+  TRIANGLE_OSCILLATOR,
+  SAW_OSCILLATOR,
+  POLYBLEP_SQUARE_OSCILLATOR,
+  POLYBLEP_SAW_OSCILLATOR,
+  WAVETABLE_SQUARE_OSCILLATOR,
+  WAVETABLE_SAW_OSCILLATOR,
+  OSCILLATOR_TYPE_COUNT
+};
+
+// how each oscillator is named in song files
+const char* oscillatorTypeNames[OSCILLATOR_TYPE_COUNT] = {"sine", "square", "triangle", "saw",
+                                                          "polyblep_square", "polyblep_saw",
+                                                          "wavetable_square", "wavetable_saw"};
+
+typedef void (*OscillatorKernel)(float* pOutput, ma_uint32 frameCount, double* phase, double increment, float gain, float gainStep);
+
+OscillatorKernel oscillatorKernels[OSCILLATOR_TYPE_COUNT];
+const char* oscillatorKernelName = "scalar";
+
+// where the phase ends up after frameCount samples. Done in double once per call so the float math
+// inside the kernels never drifts
+double advance_phase(double phase, double increment, ma_uint32 frameCount)
+{
+  phase += increment * frameCount;
+  return phase - std::floor(phase);
+}
+
+// sin(pi * z) for z in [-0.5, 0.5]
+static inline float sine_polynomial(float z)
+{
+  const float c1 = 3.14159265f, c3 = -5.16771278f, c5 = 2.55016404f, c7 = -0.59926453f, c9 = 0.08214589f;
+  float z2 = z * z;
+  return z * (c1 + z2 * (c3 + z2 * (c5 + z2 * (c7 + z2 * c9))));
+}
+
+// the correction PolyBLEP adds around a jump of -2 at phase 0 (dt is the phase increment),
+// which takes most of the aliasing out of a naive saw or square
+static inline float polyblep(float t, float dt)
+{
+  if (t < dt)
+  {
+    t /= dt;
+    return t + t - t * t - 1.0f;
+  }
+  if (t > 1.0f - dt)
+  {
+    t = (t - 1.0f) / dt;
+    return t * t + t + t + 1.0f;
+  }
+  return 0.0f;
+}
+
+template <int TYPE>
+static inline float oscillator_shape(float p, float dt)
+{
+  switch (TYPE)
+  {
+    case POLYBLEP_SQUARE_OSCILLATOR:
+    {
+      float p2 = p + 0.5f;
+      if (p2 >= 1.0f)
+      {
+        p2 -= 1.0f;
+      }
+      return (p < 0.5f ? 1.0f : -1.0f) + polyblep(p, dt) - polyblep(p2, dt);
+    }
+    case POLYBLEP_SAW_OSCILLATOR:
+      return 2.0f * p - 1.0f - polyblep(p, dt);
+    case SINE_OSCILLATOR:
+    {
+      // sin(2 pi p) = -sin(pi y) with y = 2p - 1, folded into [-0.5, 0.5] where the polynomial is accurate
+      float y = 2.0f * p - 1.0f;
+      float z = std::copysign(0.5f - std::fabs(0.5f - std::fabs(y)), y);
+      return -sine_polynomial(z);
+    }
+    case SQUARE_OSCILLATOR:
+      return p < 0.5f ? 1.0f : -1.0f;
+    case TRIANGLE_OSCILLATOR:
+      return std::fabs(4.0f * p - 2.0f) - 1.0f;
+    default:
+      return 2.0f * p - 1.0f;
+  }
+}
+
+template <int TYPE>
+void oscillator_kernel_scalar(float* pOutput, ma_uint32 frameCount, double* phase, double increment, float gain, float gainStep)
+{
+  float p = (float) *phase;
+  float inc = (float) increment;
+  for (ma_uint32 i = 0; i < frameCount; i++)
+  {
+    pOutput[i] += oscillator_shape<TYPE>(p, inc) * (gain + i * gainStep);
+    p += inc;
+    if (p >= 1.0f)
+    {
+      p -= 1.0f;
+    }
+  }
+  *phase = advance_phase(*phase, increment, frameCount);
+}
+
+#ifdef SILLY_SYNTH_X86
+
+// SSE2 is always there on x86-64, so this is the baseline vector path
+
+// the phase is never negative, so truncating is the same as flooring
+static inline __m128 wrap_phase_sse2(__m128 p)
+{
+  return _mm_sub_ps(p, _mm_cvtepi32_ps(_mm_cvttps_epi32(p)));
+}
+
+// the same as polyblep() without the branches
+static inline __m128 polyblep_sse2(__m128 t, __m128 dt, __m128 invDt)
+{
+  const __m128 one = _mm_set1_ps(1.0f);
+  __m128 a = _mm_mul_ps(t, invDt);
+  __m128 start = _mm_sub_ps(_mm_sub_ps(_mm_add_ps(a, a), _mm_mul_ps(a, a)), one);
+  __m128 b = _mm_mul_ps(_mm_sub_ps(t, one), invDt);
+  __m128 end = _mm_add_ps(_mm_add_ps(_mm_mul_ps(b, b), _mm_add_ps(b, b)), one);
+  return _mm_or_ps(_mm_and_ps(_mm_cmplt_ps(t, dt), start), _mm_and_ps(_mm_cmpgt_ps(t, _mm_sub_ps(one, dt)), end));
+}
+
+template <int TYPE>
+static inline __m128 oscillator_shape_sse2(__m128 p, __m128 dt, __m128 invDt)
+{
+  const __m128 one = _mm_set1_ps(1.0f);
+  const __m128 half = _mm_set1_ps(0.5f);
+  const __m128 signMask = _mm_set1_ps(-0.0f);
+  switch (TYPE)
+  {
+    case POLYBLEP_SQUARE_OSCILLATOR:
+    {
+      __m128 low = _mm_cmplt_ps(p, half);
+      __m128 square = _mm_or_ps(_mm_and_ps(low, one), _mm_andnot_ps(low, _mm_set1_ps(-1.0f)));
+      __m128 p2 = wrap_phase_sse2(_mm_add_ps(p, half));
+      return _mm_sub_ps(_mm_add_ps(square, polyblep_sse2(p, dt, invDt)), polyblep_sse2(p2, dt, invDt));
+    }
+    case POLYBLEP_SAW_OSCILLATOR:
+      return _mm_sub_ps(_mm_sub_ps(_mm_add_ps(p, p), one), polyblep_sse2(p, dt, invDt));
+    case SINE_OSCILLATOR:
+    {
+      __m128 y = _mm_sub_ps(_mm_add_ps(p, p), one);
+      __m128 ySign = _mm_and_ps(y, signMask);
+      __m128 yAbs = _mm_andnot_ps(signMask, y);
+      __m128 z = _mm_or_ps(ySign, _mm_sub_ps(half, _mm_andnot_ps(signMask, _mm_sub_ps(half, yAbs))));
+      __m128 z2 = _mm_mul_ps(z, z);
+      __m128 r = _mm_add_ps(_mm_set1_ps(-0.59926453f), _mm_mul_ps(z2, _mm_set1_ps(0.08214589f)));
+      r = _mm_add_ps(_mm_set1_ps(2.55016404f), _mm_mul_ps(z2, r));
+      r = _mm_add_ps(_mm_set1_ps(-5.16771278f), _mm_mul_ps(z2, r));
+      r = _mm_add_ps(_mm_set1_ps(3.14159265f), _mm_mul_ps(z2, r));
+      return _mm_xor_ps(_mm_mul_ps(z, r), signMask);
+    }
+    case SQUARE_OSCILLATOR:
+    {
+      __m128 low = _mm_cmplt_ps(p, half);
+      return _mm_or_ps(_mm_and_ps(low, one), _mm_andnot_ps(low, _mm_set1_ps(-1.0f)));
+    }
+    case TRIANGLE_OSCILLATOR:
+      return _mm_sub_ps(_mm_andnot_ps(signMask, _mm_sub_ps(_mm_mul_ps(p, _mm_set1_ps(4.0f)), _mm_set1_ps(2.0f))), one);
+    default:
+      return _mm_sub_ps(_mm_add_ps(p, p), one);
+  }
+}
+
+template <int TYPE>
+void oscillator_kernel_sse2(float* pOutput, ma_uint32 frameCount, double* phase, double increment, float gain, float gainStep)
+{
+  const __m128 lanes = _mm_set_ps(3.0f, 2.0f, 1.0f, 0.0f);
+  float inc = (float) increment;
+  __m128 p = wrap_phase_sse2(_mm_add_ps(_mm_set1_ps((float) *phase), _mm_mul_ps(lanes, _mm_set1_ps(inc))));
+  __m128 pStep = _mm_set1_ps(4.0f * inc);
+  __m128 g = _mm_add_ps(_mm_set1_ps(gain), _mm_mul_ps(lanes, _mm_set1_ps(gainStep)));
+  __m128 gStep = _mm_set1_ps(4.0f * gainStep);
+  __m128 dt = _mm_set1_ps(inc);
+  __m128 invDt = _mm_set1_ps(1.0f / inc);
+
+  ma_uint32 i = 0;
+  for (; i + 4 <= frameCount; i += 4)
+  {
+    __m128 out = _mm_loadu_ps(pOutput + i);
+    _mm_storeu_ps(pOutput + i, _mm_add_ps(out, _mm_mul_ps(oscillator_shape_sse2<TYPE>(p, dt, invDt), g)));
+    p = wrap_phase_sse2(_mm_add_ps(p, pStep));
+    g = _mm_add_ps(g, gStep);
+  }
+
+  // finish the last few samples with the scalar code, carrying on from lane 0
+  float pTail = _mm_cvtss_f32(p);
+  float gTail = _mm_cvtss_f32(g);
+  for (ma_uint32 j = 0; i < frameCount; i++, j++)
+  {
+    pOutput[i] += oscillator_shape<TYPE>(pTail, inc) * (gTail + j * gainStep);
+    pTail += inc;
+    if (pTail >= 1.0f)
+    {
+      pTail -= 1.0f;
+    }
+  }
+  *phase = advance_phase(*phase, increment, frameCount);
+}
+
+__attribute__((target("avx2"))) static inline __m256 polyblep_avx2(__m256 t, __m256 dt, __m256 invDt)
+{
+  const __m256 one = _mm256_set1_ps(1.0f);
+  __m256 a = _mm256_mul_ps(t, invDt);
+  __m256 start = _mm256_sub_ps(_mm256_sub_ps(_mm256_add_ps(a, a), _mm256_mul_ps(a, a)), one);
+  __m256 b = _mm256_mul_ps(_mm256_sub_ps(t, one), invDt);
+  __m256 end = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(b, b), _mm256_add_ps(b, b)), one);
+  return _mm256_or_ps(_mm256_and_ps(_mm256_cmp_ps(t, dt, _CMP_LT_OQ), start),
+                      _mm256_and_ps(_mm256_cmp_ps(t, _mm256_sub_ps(one, dt), _CMP_GT_OQ), end));
+}
+
+template <int TYPE>
+__attribute__((target("avx2"))) static inline __m256 oscillator_shape_avx2(__m256 p, __m256 dt, __m256 invDt)
+{
+  const __m256 one = _mm256_set1_ps(1.0f);
+  const __m256 half = _mm256_set1_ps(0.5f);
+  const __m256 signMask = _mm256_set1_ps(-0.0f);
+  switch (TYPE)
+  {
+    case POLYBLEP_SQUARE_OSCILLATOR:
+    {
+      __m256 square = _mm256_blendv_ps(_mm256_set1_ps(-1.0f), one, _mm256_cmp_ps(p, half, _CMP_LT_OQ));
+      __m256 p2 = _mm256_add_ps(p, half);
+      p2 = _mm256_sub_ps(p2, _mm256_floor_ps(p2));
+      return _mm256_sub_ps(_mm256_add_ps(square, polyblep_avx2(p, dt, invDt)), polyblep_avx2(p2, dt, invDt));
+    }
+    case POLYBLEP_SAW_OSCILLATOR:
+      return _mm256_sub_ps(_mm256_sub_ps(_mm256_add_ps(p, p), one), polyblep_avx2(p, dt, invDt));
+    case SINE_OSCILLATOR:
+    {
+      __m256 y = _mm256_sub_ps(_mm256_add_ps(p, p), one);
+      __m256 ySign = _mm256_and_ps(y, signMask);
+      __m256 yAbs = _mm256_andnot_ps(signMask, y);
+      __m256 z = _mm256_or_ps(ySign, _mm256_sub_ps(half, _mm256_andnot_ps(signMask, _mm256_sub_ps(half, yAbs))));
+      __m256 z2 = _mm256_mul_ps(z, z);
+      __m256 r = _mm256_add_ps(_mm256_set1_ps(-0.59926453f), _mm256_mul_ps(z2, _mm256_set1_ps(0.08214589f)));
+      r = _mm256_add_ps(_mm256_set1_ps(2.55016404f), _mm256_mul_ps(z2, r));
+      r = _mm256_add_ps(_mm256_set1_ps(-5.16771278f), _mm256_mul_ps(z2, r));
+      r = _mm256_add_ps(_mm256_set1_ps(3.14159265f), _mm256_mul_ps(z2, r));
+      return _mm256_xor_ps(_mm256_mul_ps(z, r), signMask);
+    }
+    case SQUARE_OSCILLATOR:
+      return _mm256_blendv_ps(_mm256_set1_ps(-1.0f), one, _mm256_cmp_ps(p, half, _CMP_LT_OQ));
+    case TRIANGLE_OSCILLATOR:
+      return _mm256_sub_ps(_mm256_andnot_ps(signMask, _mm256_sub_ps(_mm256_mul_ps(p, _mm256_set1_ps(4.0f)), _mm256_set1_ps(2.0f))), one);
+    default:
+      return _mm256_sub_ps(_mm256_add_ps(p, p), one);
+  }
+}
+
+template <int TYPE>
+__attribute__((target("avx2"))) void oscillator_kernel_avx2(float* pOutput, ma_uint32 frameCount, double* phase, double increment, float gain, float gainStep)
+{
+  const __m256 lanes = _mm256_set_ps(7.0f, 6.0f, 5.0f, 4.0f, 3.0f, 2.0f, 1.0f, 0.0f);
+  float inc = (float) increment;
+  __m256 p = _mm256_add_ps(_mm256_set1_ps((float) *phase), _mm256_mul_ps(lanes, _mm256_set1_ps(inc)));
+  p = _mm256_sub_ps(p, _mm256_floor_ps(p));
+  __m256 pStep = _mm256_set1_ps(8.0f * inc);
+  __m256 g = _mm256_add_ps(_mm256_set1_ps(gain), _mm256_mul_ps(lanes, _mm256_set1_ps(gainStep)));
+  __m256 gStep = _mm256_set1_ps(8.0f * gainStep);
+  __m256 dt = _mm256_set1_ps(inc);
+  __m256 invDt = _mm256_set1_ps(1.0f / inc);
+
+  ma_uint32 i = 0;
+  for (; i + 8 <= frameCount; i += 8)
+  {
+    __m256 out = _mm256_loadu_ps(pOutput + i);
+    _mm256_storeu_ps(pOutput + i, _mm256_add_ps(out, _mm256_mul_ps(oscillator_shape_avx2<TYPE>(p, dt, invDt), g)));
+    p = _mm256_add_ps(p, pStep);
+    p = _mm256_sub_ps(p, _mm256_floor_ps(p));
+    g = _mm256_add_ps(g, gStep);
+  }
+
+  float pTail = _mm256_cvtss_f32(p);
+  float gTail = _mm256_cvtss_f32(g);
+  for (ma_uint32 j = 0; i < frameCount; i++, j++)
+  {
+    pOutput[i] += oscillator_shape<TYPE>(pTail, inc) * (gTail + j * gainStep);
+    pTail += inc;
+    if (pTail >= 1.0f)
+    {
+      pTail -= 1.0f;
+    }
+  }
+  *phase = advance_phase(*phase, increment, frameCount);
+}
+
+#endif
+
+// band limited square and saw tables, one per octave. Level l only has harmonics up to
+// WAVETABLE_MAX_HARMONICS >> l, and a note plays from the fullest level that stays under nyquist.
+// Each table has one extra sample (a copy of the first) so interpolation never wraps
+float squareWavetables[WAVETABLE_LEVELS][WAVETABLE_SIZE + 1];
+float sawWavetables[WAVETABLE_LEVELS][WAVETABLE_SIZE + 1];
+
+// additive synthesis, done once at startup
+void init_wavetables()
+{
+  vector<double> sineTable(WAVETABLE_SIZE);
+  for (int i = 0; i < WAVETABLE_SIZE; i++)
+  {
+    sineTable[i] = std::sin(2.0 * M_PI * i / WAVETABLE_SIZE);
+  }
+
+  for (int level = 0; level < WAVETABLE_LEVELS; level++)
+  {
+    int harmonics = WAVETABLE_MAX_HARMONICS >> level;
+    for (int i = 0; i < WAVETABLE_SIZE; i++)
+    {
+      double square = 0.0;
+      double saw = 0.0;
+      for (int h = 1; h <= harmonics; h++)
+      {
+        // k * i can be reduced exactly, so every harmonic comes out of the same table
+        double partial = sineTable[((long) h * i) % WAVETABLE_SIZE] / h;
+        saw += partial;
+        if (h % 2 == 1)
+        {
+          square += partial;
+        }
+      }
+      squareWavetables[level][i] = (float) (4.0 / M_PI * square);
+      sawWavetables[level][i] = (float) (-2.0 / M_PI * saw);
+    }
+    squareWavetables[level][WAVETABLE_SIZE] = squareWavetables[level][0];
+    sawWavetables[level][WAVETABLE_SIZE] = sawWavetables[level][0];
+  }
+}
+
+int wavetable_level(double increment)
+{
+  double harmonicsAllowed = 0.5 / increment;
+  int level = 0;
+  while (level < WAVETABLE_LEVELS - 1 && (WAVETABLE_MAX_HARMONICS >> level) > harmonicsAllowed)
+  {
+    level++;
+  }
+  return level;
+}
+
+template <int TYPE>
+void oscillator_kernel_wavetable(float* pOutput, ma_uint32 frameCount, double* phase, double increment, float gain, float gainStep)
+{
+  const float* table = (TYPE == WAVETABLE_SQUARE_OSCILLATOR ? squareWavetables : sawWavetables)[wavetable_level(increment)];
+  float p = (float) *phase * WAVETABLE_SIZE;
+  float inc = (float) (increment * WAVETABLE_SIZE);
+  if (p >= WAVETABLE_SIZE)
+  {
+    p -= WAVETABLE_SIZE; // a phase just under 1 can round up to a whole cycle
+  }
+  for (ma_uint32 i = 0; i < frameCount; i++)
+  {
+    int index = (int) p;
+    float fraction = p - index;
+    float sample = table[index] + fraction * (table[index + 1] - table[index]);
+    pOutput[i] += sample * (gain + i * gainStep);
+    p += inc;
+    if (p >= WAVETABLE_SIZE)
+    {
+      p -= WAVETABLE_SIZE;
+    }
+  }
+  *phase = advance_phase(*phase, increment, frameCount);
+}
+
+#ifdef SILLY_SYNTH_X86
+
+template <int TYPE>
+__attribute__((target("avx2"))) void oscillator_kernel_wavetable_avx2(float* pOutput, ma_uint32 frameCount, double* phase, double increment, float gain, float gainStep)
+{
+  const float* table = (TYPE == WAVETABLE_SQUARE_OSCILLATOR ? squareWavetables : sawWavetables)[wavetable_level(increment)];
+  const __m256 lanes = _mm256_set_ps(7.0f, 6.0f, 5.0f, 4.0f, 3.0f, 2.0f, 1.0f, 0.0f);
+  const __m256 size = _mm256_set1_ps((float) WAVETABLE_SIZE);
+  float inc = (float) increment;
+  __m256 p = _mm256_add_ps(_mm256_set1_ps((float) *phase), _mm256_mul_ps(lanes, _mm256_set1_ps(inc)));
+  p = _mm256_sub_ps(p, _mm256_floor_ps(p));
+  __m256 pStep = _mm256_set1_ps(8.0f * inc);
+  __m256 g = _mm256_add_ps(_mm256_set1_ps(gain), _mm256_mul_ps(lanes, _mm256_set1_ps(gainStep)));
+  __m256 gStep = _mm256_set1_ps(8.0f * gainStep);
+
+  ma_uint32 i = 0;
+  for (; i + 8 <= frameCount; i += 8)
+  {
+    __m256 position = _mm256_mul_ps(p, size);
+    __m256i index = _mm256_cvttps_epi32(position);
+    // a phase just under 1 can round up to a whole table, so clamp onto the guard sample
+    index = _mm256_min_epi32(index, _mm256_set1_epi32(WAVETABLE_SIZE - 1));
+    __m256 fraction = _mm256_sub_ps(position, _mm256_cvtepi32_ps(index));
+    __m256 a = _mm256_i32gather_ps(table, index, 4);
+    __m256 b = _mm256_i32gather_ps(table + 1, index, 4);
+    __m256 sample = _mm256_add_ps(a, _mm256_mul_ps(fraction, _mm256_sub_ps(b, a)));
+    __m256 out = _mm256_loadu_ps(pOutput + i);
+    _mm256_storeu_ps(pOutput + i, _mm256_add_ps(out, _mm256_mul_ps(sample, g)));
+    p = _mm256_add_ps(p, pStep);
+    p = _mm256_sub_ps(p, _mm256_floor_ps(p));
+    g = _mm256_add_ps(g, gStep);
+  }
+
+  // the scalar kernel finishes the tail from where lane 0 got to
+  double tailPhase = _mm256_cvtss_f32(p);
+  oscillator_kernel_wavetable<TYPE>(pOutput + i, frameCount - i, &tailPhase, increment, _mm256_cvtss_f32(g), gainStep);
+  *phase = advance_phase(*phase, increment, frameCount);
+}
+
+#endif
+
+// the inner loop of the fir filters: the dot product of taps coefficients with taps samples.
+// taps is always a multiple of 16, so the vector versions have no tail
+typedef float (*FirKernel)(const float* coefficients, const float* samples, int taps);
+
+FirKernel firKernel;
+
+float fir_kernel_scalar(const float* coefficients, const float* samples, int taps)
+{
+  float sum[4] = {0.0f, 0.0f, 0.0f, 0.0f};
+  for (int k = 0; k < taps; k += 4)
+  {
+    for (int j = 0; j < 4; j++)
+    {
+      sum[j] += coefficients[k + j] * samples[k + j];
+    }
+  }
+  return (sum[0] + sum[1]) + (sum[2] + sum[3]);
+}
+
+#ifdef SILLY_SYNTH_X86
+
+float fir_kernel_sse2(const float* coefficients, const float* samples, int taps)
+{
+  __m128 sum0 = _mm_setzero_ps();
+  __m128 sum1 = _mm_setzero_ps();
+  for (int k = 0; k < taps; k += 8)
+  {
+    sum0 = _mm_add_ps(sum0, _mm_mul_ps(_mm_loadu_ps(coefficients + k), _mm_loadu_ps(samples + k)));
+    sum1 = _mm_add_ps(sum1, _mm_mul_ps(_mm_loadu_ps(coefficients + k + 4), _mm_loadu_ps(samples + k + 4)));
+  }
+  __m128 sum = _mm_add_ps(sum0, sum1);
+  sum = _mm_add_ps(sum, _mm_movehl_ps(sum, sum));
+  sum = _mm_add_ss(sum, _mm_shuffle_ps(sum, sum, 1));
+  return _mm_cvtss_f32(sum);
+}
+
+__attribute__((target("avx2"))) float fir_kernel_avx2(const float* coefficients, const float* samples, int taps)
+{
+  __m256 sum0 = _mm256_setzero_ps();
+  __m256 sum1 = _mm256_setzero_ps();
+  for (int k = 0; k < taps; k += 16)
+  {
+    sum0 = _mm256_add_ps(sum0, _mm256_mul_ps(_mm256_loadu_ps(coefficients + k), _mm256_loadu_ps(samples + k)));
+    sum1 = _mm256_add_ps(sum1, _mm256_mul_ps(_mm256_loadu_ps(coefficients + k + 8), _mm256_loadu_ps(samples + k + 8)));
+  }
+  __m256 sum8 = _mm256_add_ps(sum0, sum1);
+  __m128 sum = _mm_add_ps(_mm256_castps256_ps128(sum8), _mm256_extractf128_ps(sum8, 1));
+  sum = _mm_add_ps(sum, _mm_movehl_ps(sum, sum));
+  sum = _mm_add_ss(sum, _mm_shuffle_ps(sum, sum, 1));
+  return _mm_cvtss_f32(sum);
+}
+
+#endif
+
+// for the kaiser windows of the fir filters
+double bessel_i0(double x)
+{
+  double sum = 1.0;
+  double term = 1.0;
+  for (int k = 1; k < 50; k++)
+  {
+    term *= (x / (2 * k)) * (x / (2 * k));
+    sum += term;
+  }
+  return sum;
+}
+
+// the instruction sets there are oscillator kernels for
+enum KernelSet
+{
+  SCALAR_KERNELS,
+  SSE2_KERNELS,
+  AVX2_KERNELS,
+  KERNEL_SET_COUNT
+};
+
+const char* kernelSetNames[KERNEL_SET_COUNT] = {"scalar", "sse2", "avx2"};
+
+bool kernel_set_supported(KernelSet set)
+{
+#ifdef SILLY_SYNTH_X86
+  __builtin_cpu_init();
+  return set == SCALAR_KERNELS || (set == SSE2_KERNELS && __builtin_cpu_supports("sse2"))
+         || (set == AVX2_KERNELS && __builtin_cpu_supports("avx2"));
+#else
+  return set == SCALAR_KERNELS;
+#endif
+}
+
+#define SET_OSCILLATOR_KERNELS(kernels, kernel) \
+  kernels[SINE_OSCILLATOR] = kernel<SINE_OSCILLATOR>; \
+  kernels[SQUARE_OSCILLATOR] = kernel<SQUARE_OSCILLATOR>; \
+  kernels[TRIANGLE_OSCILLATOR] = kernel<TRIANGLE_OSCILLATOR>; \
+  kernels[SAW_OSCILLATOR] = kernel<SAW_OSCILLATOR>; \
+  kernels[POLYBLEP_SQUARE_OSCILLATOR] = kernel<POLYBLEP_SQUARE_OSCILLATOR>; \
+  kernels[POLYBLEP_SAW_OSCILLATOR] = kernel<POLYBLEP_SAW_OSCILLATOR>;
+
+// fills kernels with the oscillator kernels of one supported instruction set. The wavetables only have a scalar
+// and an avx2 kernel, sse2 uses the scalar one
+void get_oscillator_kernels(KernelSet set, OscillatorKernel* kernels)
+{
+  SET_OSCILLATOR_KERNELS(kernels, oscillator_kernel_scalar);
+  kernels[WAVETABLE_SQUARE_OSCILLATOR] = oscillator_kernel_wavetable<WAVETABLE_SQUARE_OSCILLATOR>;
+  kernels[WAVETABLE_SAW_OSCILLATOR] = oscillator_kernel_wavetable<WAVETABLE_SAW_OSCILLATOR>;
+#ifdef SILLY_SYNTH_X86
+  if (set == SSE2_KERNELS)
+  {
+    SET_OSCILLATOR_KERNELS(kernels, oscillator_kernel_sse2);
+  }
+  else if (set == AVX2_KERNELS)
+  {
+    SET_OSCILLATOR_KERNELS(kernels, oscillator_kernel_avx2);
+    kernels[WAVETABLE_SQUARE_OSCILLATOR] = oscillator_kernel_wavetable_avx2<WAVETABLE_SQUARE_OSCILLATOR>;
+    kernels[WAVETABLE_SAW_OSCILLATOR] = oscillator_kernel_wavetable_avx2<WAVETABLE_SAW_OSCILLATOR>;
+  }
+#endif
+}
+
+// picks the fastest kernels this cpu can run
+void init_oscillator_kernels()
+{
+  init_wavetables();
+  KernelSet set = SCALAR_KERNELS;
+  firKernel = fir_kernel_scalar;
+#ifdef SILLY_SYNTH_X86
+  if (kernel_set_supported(AVX2_KERNELS))
+  {
+    set = AVX2_KERNELS;
+    firKernel = fir_kernel_avx2;
+  }
+  else if (kernel_set_supported(SSE2_KERNELS))
+  {
+    set = SSE2_KERNELS;
+    firKernel = fir_kernel_sse2;
+  }
+#endif
+  get_oscillator_kernels(set, oscillatorKernels);
+  oscillatorKernelName = kernelSetNames[set];
+}
+
+int selectedWaveform = 0;
+
+OscillatorType oscillator_type_from_selection(int selection)
+{
+  if (selection < 0 || selection >= OSCILLATOR_TYPE_COUNT)
+  {
+    return SINE_OSCILLATOR;
+  }
+  return (OscillatorType) selection;
+}
+
+// which voice a new note takes over when every voice is busy
+enum VoiceStealPolicy
+{
+  STEAL_OLDEST,
+  STEAL_QUIETEST
+};
+const char* voiceStealPolicyNames[] = {"oldest", "quietest"};
+
+#define PREVIEW_NOTE_START -1 // noteStart of the voice playing the note being edited
+
+// a voice plays one note. Voices are preallocated in a VoicePool so the audio thread never allocates,
+// and a note gets a voice only while it is sounding
+struct Voice
+{
+  bool active;
+  bool releasing;
+  int key;
+  int noteStart;      // start column of the note this voice plays, to tell repeated notes apart
+  float velocity;
+  int bus;
+  float panLeft;          // gains into the left and right channel of the bus
+  float panRight;
+  ma_uint64 age;          // when the note started, for stealing the oldest voice
+  ma_uint64 startFrame;   // pool frame the note started at
+  ma_uint64 releaseFrame; // pool frame the note was let go at
+  float releaseLevel;     // envelope level at releaseFrame, the release ramps down from it
+  double phaseIncrement;
+};
+
+struct VoicePool
+{
+  Voice voices[MAX_VOICES];
+  int voiceCount;     // how many of the voices may be used
+  VoiceStealPolicy stealPolicy;
+  ma_uint64 noteOnCount;
+  // the envelope in frames. It is made of straight lines so each piece of it is one gain ramp in the kernels
+  ma_uint32 attackFrames;
+  ma_uint32 decayFrames;
+  float sustainLevel;
+  ma_uint32 releaseFrames; // how long a released voice takes to fade out
+  // frames rendered so far. The phase and gain of every voice are worked out from this and not accumulated,
+  // so a pool can be set up to carry on from any frame and still sound the same
+  ma_uint64 frame;
+  int syncedColumn;   // the column the voices were last matched to, -1 to match again
+  // song notes whose voice was stolen while they were held. A key plays one note at a time, so the key and the
+  // note's start column tell which note it was, and the note stays silent until it ends
+  KeyMask stolenKeys;
+  int stolenNoteStarts[MAX_PIANO_KEYS];
+  OscillatorType waveform;
+  ma_uint32 sampleRate;
+  // the mixer, structure of arrays: bus b's left channel is MIXER_BLOCK_FRAMES floats at
+  // busSamples + 2 * b * MIXER_BLOCK_FRAMES, with its right channel right after it
+  float* busSamples;
+  float* voiceSamples;    // one voice before it is panned into its bus
+};
+
+// attack, decay and release are in seconds, sustain is a level from 0 to 1
+struct Envelope
+{
+  double attack;
+  double decay;
+  float sustain;
+  double release;
+};
+
+VoicePool voicePool; // only touched by the audio thread once the device is started
+int voiceCount = MAX_VOICES;                      // --voices
+VoiceStealPolicy voiceStealPolicy = STEAL_OLDEST; // --steal
+Envelope voiceEnvelope = {VOICE_ATTACK_TIME, VOICE_DECAY_TIME, 1.0f, VOICE_RELEASE_TIME};
+
+void init_voice_pool(VoicePool* pool, OscillatorType waveform, ma_uint32 sampleRate)
+{
+  for (int v = 0; v < MAX_VOICES; v++)
+  {
+    Voice* voice = &pool->voices[v];
+    voice->active = false;
+    voice->releasing = false;
+  }
+  pool->waveform = waveform;
+  pool->sampleRate = sampleRate;
+  pool->voiceCount = std::min(std::max(voiceCount, 1), MAX_VOICES);
+  pool->stealPolicy = voiceStealPolicy;
+  pool->noteOnCount = 0;
+  pool->attackFrames = (ma_uint32) std::ceil(voiceEnvelope.attack * sampleRate);
+  pool->decayFrames = (ma_uint32) std::ceil(voiceEnvelope.decay * sampleRate);
+  pool->sustainLevel = std::min(std::max(voiceEnvelope.sustain, 0.0f), 1.0f);
+  pool->releaseFrames = std::max((ma_uint32) std::ceil(voiceEnvelope.release * sampleRate), (ma_uint32) 1);
+  pool->syncedColumn = -1;
+  pool->stolenKeys = KeyMask{};
+  pool->frame = 0;
+  pool->busSamples = (float*) ma_aligned_malloc(MIX_BUSES * 2 * MIXER_BLOCK_FRAMES * sizeof(float), MIX_BUS_ALIGNMENT, NULL);
+  pool->voiceSamples = (float*) ma_aligned_malloc(MIXER_BLOCK_FRAMES * sizeof(float), MIX_BUS_ALIGNMENT, NULL);
+}
+
+void uninit_voice_pool(VoicePool* pool)
+{
+  ma_aligned_free(pool->busSamples, NULL);
+  ma_aligned_free(pool->voiceSamples, NULL);
+}
+
+// the middle keeps full level in both channels, and the gains follow a constant power curve out to the sides
+void pan_gains(float pan, float* left, float* right)
+{
+  double angle = (std::min(std::max(pan, -1.0f), 1.0f) + 1.0) * M_PI / 4;
+  *left = (float) (M_SQRT2 * std::cos(angle));
+  *right = (float) (M_SQRT2 * std::sin(angle));
+}
+
+// where the voice's wave is at the current frame of the pool (in cycles, from 0 up to 1)
+double voice_phase(const VoicePool* pool, const Voice* voice)
+{
+  double phase = voice->phaseIncrement * (double) (pool->frame - voice->startFrame);
+  return phase - std::floor(phase);
+}
+
+// the voice's envelope level at frame, with the gain it changes by per frame and how many frames it keeps on that
+// line. The line is worked out from where frame falls in the envelope, so it doesn't matter how the voice got there.
+// A voice whose release is over gets 0 frames
+float voice_envelope(const VoicePool* pool, const Voice* voice, ma_uint64 frame, float* step, ma_uint32* frames)
+{
+  if (voice->releasing)
+  {
+    ma_uint64 released = frame - voice->releaseFrame;
+    if (released >= pool->releaseFrames)
+    {
+      *step = 0.0f;
+      *frames = 0;
+      return 0.0f;
+    }
+    *step = -voice->releaseLevel / pool->releaseFrames;
+    *frames = pool->releaseFrames - (ma_uint32) released;
+    return voice->releaseLevel + (float) released * *step;
+  }
+
+  ma_uint64 held = frame - voice->startFrame;
+  if (held < pool->attackFrames)
+  {
+    *step = 1.0f / pool->attackFrames;
+    *frames = pool->attackFrames - (ma_uint32) held;
+    return (float) held * *step;
+  }
+  held -= pool->attackFrames;
+  // a decay to full level is just more sustain, and isn't split off from it
+  if (held < pool->decayFrames && pool->sustainLevel < 1.0f)
+  {
+    *step = -(1.0f - pool->sustainLevel) / pool->decayFrames;
+    *frames = pool->decayFrames - (ma_uint32) held;
+    return 1.0f + (float) held * *step;
+  }
+  *step = 0.0f;
+  *frames = UINT32_MAX;
+  return pool->sustainLevel;
+}
+
+// the voice's envelope level at the current frame of the pool
+float voice_gain(const VoicePool* pool, const Voice* voice)
+{
+  float step;
+  ma_uint32 frames;
+  return voice_envelope(pool, voice, pool->frame, &step, &frames);
+}
+
+void set_voice_pool_waveform(VoicePool* pool, OscillatorType waveform)
+{
+  pool->waveform = waveform;
+}
+
+// a free voice if there is one, otherwise the one the steal policy gives up
+Voice* allocate_voice(VoicePool* pool)
+{
+  Voice* stolen = NULL;
+  for (int v = 0; v < pool->voiceCount; v++)
+  {
+    Voice* voice = &pool->voices[v];
+    if (!voice->active)
+    {
+      return voice;
+    }
+    if (stolen == NULL)
+    {
+      stolen = voice;
+    }
+    else if (pool->stealPolicy == STEAL_QUIETEST)
+    {
+      float level = voice->velocity * voice_gain(pool, voice);
+      float stolenLevel = stolen->velocity * voice_gain(pool, stolen);
+      if (level < stolenLevel || (level == stolenLevel && voice->age < stolen->age))
+      {
+        stolen = voice;
+      }
+    }
+    else if (voice->age < stolen->age)
+    {
+      stolen = voice;
+    }
+  }
+  return stolen;
+}
+
+void note_on(VoicePool* pool, int key, int noteStart, float velocity, float pan, int bus)
+{
+  Voice* voice = allocate_voice(pool);
+  if (voice->active && !voice->releasing && voice->noteStart != PREVIEW_NOTE_START)
+  {
+    set_key_in_mask(&pool->stolenKeys, voice->key, true);
+    pool->stolenNoteStarts[voice->key] = voice->noteStart;
+  }
+  voice->active = true;
+  voice->releasing = false;
+  voice->key = key;
+  voice->noteStart = noteStart;
+  voice->velocity = velocity;
+  voice->bus = std::min(std::max(bus, 0), MIX_BUSES - 1);
+  pan_gains(pan, &voice->panLeft, &voice->panRight);
+  voice->age = pool->noteOnCount++;
+  // every note starts at the beginning of its wave
+  voice->startFrame = pool->frame;
+  voice->phaseIncrement = pitch_from_note(key + baseKeyNote) / pool->sampleRate;
+}
+
+void release_voice(VoicePool* pool, Voice* voice)
+{
+  if (!voice->releasing)
+  {
+    voice->releaseLevel = voice_gain(pool, voice);
+    voice->releasing = true;
+    voice->releaseFrame = pool->frame;
+  }
+}
+
+// frees the voices that have finished fading out by the current frame
+void expire_voices(VoicePool* pool)
+{
+  for (int v = 0; v < MAX_VOICES; v++)
+  {
+    Voice* voice = &pool->voices[v];
+    if (voice->active && voice->releasing && pool->frame - voice->releaseFrame >= pool->releaseFrames)
+    {
+      voice->active = false;
+    }
+  }
+}
+
+void release_all_voices(VoicePool* pool)
+{
+  for (int v = 0; v < MAX_VOICES; v++)
+  {
+    if (pool->voices[v].active)
+    {
+      release_voice(pool, &pool->voices[v]);
+    }
+  }
+  pool->syncedColumn = -1;
+  // playing from somewhere else gives every note a voice again
+  pool->stolenKeys = KeyMask{};
+}
+
+// releases the voices whose notes ended and starts voices for notes that begin at column
+void sync_voices_to_column(VoicePool* pool, const NoteStore* song, int column)
+{
+  // a key plays one note at a time, so the notes at column are told apart by their key
+  const NoteBucket* bucket = get_bucket(song, column);
+  KeyMask sounding = {};
+  int soundingStarts[MAX_PIANO_KEYS];
+  for (int n = 0; bucket != NULL && n < (int) bucket->events.size(); n++)
+  {
+    const NoteEvent& e = bucket->events[n];
+    if (e.start <= column && column < note_end(e))
+    {
+      set_key_in_mask(&sounding, e.key, true);
+      soundingStarts[e.key] = e.start;
+    }
+  }
+
+  KeyMask voiced = {};
+  for (int v = 0; v < MAX_VOICES; v++)
+  {
+    Voice* voice = &pool->voices[v];
+    if (!voice->active || voice->releasing || voice->noteStart == PREVIEW_NOTE_START)
+    {
+      continue;
+    }
+    if (key_in_mask(sounding, voice->key) && soundingStarts[voice->key] == voice->noteStart)
+    {
+      set_key_in_mask(&voiced, voice->key, true);
+    }
+    else
+    {
+      release_voice(pool, voice);
+    }
+  }
+
+  // a stolen note is forgotten once it ends, and until then it doesn't take a voice back
+  for (int key = next_key_in_mask(pool->stolenKeys, 0, true); key < MAX_PIANO_KEYS;
+       key = next_key_in_mask(pool->stolenKeys, key + 1, true))
+  {
+    if (key_in_mask(sounding, key) && soundingStarts[key] == pool->stolenNoteStarts[key])
+    {
+      set_key_in_mask(&voiced, key, true);
+    }
+    else
+    {
+      set_key_in_mask(&pool->stolenKeys, key, false);
+    }
+  }
+
+  for (int n = 0; bucket != NULL && n < (int) bucket->events.size(); n++)
+  {
+    const NoteEvent& e = bucket->events[n];
+    if (e.start <= column && column < note_end(e) && !key_in_mask(voiced, e.key))
+    {
+      note_on(pool, e.key, e.start, e.velocity, e.pan, e.bus);
+    }
+  }
+  pool->syncedColumn = column;
+}
+
+// a preallocated, aligned buffer the voices are mixed into. Buses are only ever allocated up front (the device's
+// one when the device is set up), never on the audio thread. A bus with more than one channel keeps them one
+// after the other, capacity floats each
+struct MixBus
+{
+  float* samples;
+  ma_uint32 capacity; // in frames
+};
+
+MixBus deviceBus;   // stereo
+
+void init_mix_bus(MixBus* bus, ma_uint32 capacity, ma_uint32 channels = 1)
+{
+  bus->capacity = capacity;
+  bus->samples = (float*) ma_aligned_malloc(capacity * channels * sizeof(float), MIX_BUS_ALIGNMENT, NULL);
+}
+
+float* mix_bus_channel(const MixBus* bus, ma_uint32 channel)
+{
+  return bus->samples + channel * bus->capacity;
+}
+
+void uninit_mix_bus(MixBus* bus)
+{
+  ma_aligned_free(bus->samples, NULL);
+  bus->samples = NULL;
+  bus->capacity = 0;
+}
+
+// oversampling runs the synth at 2x or 4x the rate it is played or exported at, so the harmonics of the naive
+// oscillators that would fold back below nyquist land above it instead, and filters them out on the way down.
+// Each halving is a halfband fir: every other coefficient is zero except the middle one, which is 1/2. Split into
+// even and odd inputs, the odd ones only meet the middle tap and the even ones are one dot product of taps
+// coefficients, done by the same simd kernel the resampler uses. Everything is allocated up front, so this can
+// run on the audio thread
+struct HalfbandDecimator
+{
+  int taps;              // coefficients besides the middle one, a multiple of 16
+  float* coefficients;
+  float* even;           // the last taps - 1 even inputs, then the even inputs of this pass
+  float* odd;            // the last taps / 2 odd inputs, then the odd inputs of this pass
+};
+
+struct Oversampler
+{
+  int factor;            // 1, 2 or 4
+  ma_uint32 capacity;    // output frames per pass
+  int stageCount;
+  HalfbandDecimator stages[2];
+  MixBus between;        // what the first stage hands the second at 4x
+};
+
+// the device bus holds what the device gets, this holds the liveOversampling times as many frames it is made from.
+// One oversampler per channel
+Oversampler deviceOversamplers[2];
+MixBus oversampledDeviceBus;
+
+void init_halfband_decimator(HalfbandDecimator* d, int taps, ma_uint32 outputCapacity)
+{
+  d->taps = taps;
+  d->coefficients = (float*) ma_aligned_malloc(taps * sizeof(float), MIX_BUS_ALIGNMENT, NULL);
+  double sum = 0.0;
+  for (int i = 0; i < taps; i++)
+  {
+    // how many inputs coefficient i is away from the middle tap, always odd
+    double offset = 2 * i - taps + 1;
+    double w = offset / taps;
+    double window = bessel_i0(HALFBAND_BETA * std::sqrt(1.0 - w * w)) / bessel_i0(HALFBAND_BETA);
+    double coefficient = std::sin(M_PI * offset / 2) / (M_PI * offset) * window;
+    d->coefficients[i] = (float) coefficient;
+    sum += coefficient;
+  }
+  // with the middle tap dc passes at exactly unity gain
+  for (int i = 0; i < taps; i++)
+  {
+    d->coefficients[i] = (float) (d->coefficients[i] * 0.5 / sum);
+  }
+  d->even = (float*) ma_aligned_malloc((taps - 1 + outputCapacity) * sizeof(float), MIX_BUS_ALIGNMENT, NULL);
+  d->odd = (float*) ma_aligned_malloc((taps / 2 + outputCapacity) * sizeof(float), MIX_BUS_ALIGNMENT, NULL);
+  memset(d->even, 0, (taps - 1) * sizeof(float));
+  memset(d->odd, 0, taps / 2 * sizeof(float));
+}
+
+void uninit_halfband_decimator(HalfbandDecimator* d)
+{
+  ma_aligned_free(d->coefficients, NULL);
+  ma_aligned_free(d->even, NULL);
+  ma_aligned_free(d->odd, NULL);
+}
+
+// turns outputFrames * 2 inputs into outputFrames outputs. Every output only depends on the inputs, never on how
+// they were split into passes
+void decimate(HalfbandDecimator* d, const float* pInput, ma_uint32 outputFrames, float* pOutput)
+{
+  int taps = d->taps;
+  float* even = d->even + taps - 1;
+  float* odd = d->odd + taps / 2;
+  for (ma_uint32 i = 0; i < outputFrames; i++)
+  {
+    even[i] = pInput[2 * i];
+    odd[i] = pInput[2 * i + 1];
+  }
+  for (ma_uint32 i = 0; i < outputFrames; i++)
+  {
+    pOutput[i] = firKernel(d->coefficients, d->even + i, taps) + 0.5f * d->odd[i];
+  }
+  memmove(d->even, d->even + outputFrames, (taps - 1) * sizeof(float));
+  memmove(d->odd, d->odd + outputFrames, taps / 2 * sizeof(float));
+}
+
+// at 4x the first halving can get away with a shorter filter, since what it has to remove is a long way above
+// anything the second one lets through
+void init_oversampler(Oversampler* o, int factor, ma_uint32 capacity)
+{
+  o->factor = factor;
+  o->capacity = capacity;
+  o->stageCount = factor == 4 ? 2 : factor == 2 ? 1 : 0;
+  o->between.samples = NULL;
+  if (factor == 4)
+  {
+    init_halfband_decimator(&o->stages[0], HALFBAND_SHORT_TAPS, capacity * 2);
+    init_halfband_decimator(&o->stages[1], HALFBAND_TAPS, capacity);
+    init_mix_bus(&o->between, capacity * 2);
+  }
+  else if (factor == 2)
+  {
+    init_halfband_decimator(&o->stages[0], HALFBAND_TAPS, capacity);
+  }
+}
+
+void uninit_oversampler(Oversampler* o)
+{
+  for (int s = 0; s < o->stageCount; s++)
+  {
+    uninit_halfband_decimator(&o->stages[s]);
+  }
+  if (o->between.samples != NULL)
+  {
+    uninit_mix_bus(&o->between);
+  }
+  o->stageCount = 0;
+}
+
+// forgets everything that came before, as if the input so far had been silence
+void reset_oversampler(Oversampler* o)
+{
+  for (int s = 0; s < o->stageCount; s++)
+  {
+    memset(o->stages[s].even, 0, (o->stages[s].taps - 1) * sizeof(float));
+    memset(o->stages[s].odd, 0, o->stages[s].taps / 2 * sizeof(float));
+  }
+}
+
+// turns frameCount * factor frames at the oversampled rate into frameCount frames
+void downsample(Oversampler* o, const float* pInput, ma_uint32 frameCount, float* pOutput)
+{
+  if (o->factor == 1)
+  {
+    memmove(pOutput, pInput, frameCount * sizeof(float));
+    return;
+  }
+  ma_uint32 framesDone = 0;
+  while (framesDone < frameCount)
+  {
+    ma_uint32 framesToDo = std::min(frameCount - framesDone, o->capacity);
+    const float* pStageInput = pInput + framesDone * o->factor;
+    if (o->stageCount == 2)
+    {
+      decimate(&o->stages[0], pStageInput, framesToDo * 2, o->between.samples);
+      pStageInput = o->between.samples;
+    }
+    decimate(&o->stages[o->stageCount - 1], pStageInput, framesToDo, pOutput + framesDone);
+    framesDone += framesToDo;
+  }
+}
+
+// adds one voice into pOutput and lets it go once its release is over. Each straight piece of the envelope is one
+// kernel call with a gain ramp, so there is no per-frame work for the envelope, and a voice sustaining at silence
+// isn't rendered at all
+void render_voice(VoicePool* pool, Voice* voice, OscillatorKernel kernel, float* pOutput, ma_uint32 frameCount)
+{
+  float gain = VOICE_AMPLITUDE * voice->velocity;
+  double phase = voice_phase(pool, voice);
+  ma_uint32 framesDone = 0;
+  while (framesDone < frameCount)
+  {
+    float step;
+    ma_uint32 segmentFrames;
+    float level = voice_envelope(pool, voice, pool->frame + framesDone, &step, &segmentFrames);
+    if (segmentFrames == 0 || (level == 0.0f && step == 0.0f))
+    {
+      break;
+    }
+    ma_uint32 framesToRender = std::min(frameCount - framesDone, segmentFrames);
+    kernel(pOutput + framesDone, framesToRender, &phase, voice->phaseIncrement, gain * level, gain * step);
+    framesDone += framesToRender;
+  }
+  if (voice->releasing && pool->frame + frameCount - voice->releaseFrame >= pool->releaseFrames)
+  {
+    voice->active = false;
+  }
+}
+
+// the mixer's loops go four frames at a time over buffers that can't overlap, which the compiler turns into vector
+// code without needing a scalar tail. The voice and bus buffers are MIXER_BLOCK_FRAMES long, a multiple of four,
+// so passes over them just round up
+
+void pan_into_bus(const float* __restrict pVoice, float* __restrict pBusLeft, float* __restrict pBusRight,
+                  int frameCount, float panLeft, float panRight, bool add)
+{
+  if (!add)
+  {
+    for (int i = 0; i < frameCount; i += 4)
+    {
+      for (int j = 0; j < 4; j++)
+      {
+        pBusLeft[i + j] = pVoice[i + j] * panLeft;
+        pBusRight[i + j] = pVoice[i + j] * panRight;
+      }
+    }
+    return;
+  }
+  for (int i = 0; i < frameCount; i += 4)
+  {
+    for (int j = 0; j < 4; j++)
+    {
+      pBusLeft[i + j] += pVoice[i + j] * panLeft;
+      pBusRight[i + j] += pVoice[i + j] * panRight;
+    }
+  }
+}
+
+// one pass over the output, reading every bus in use
+void sum_buses(const float* const* pBuses, const float* busGains, int busCount, float* __restrict pLeft,
+               float* __restrict pRight, int frameCount)
+{
+  int i = 0;
+  for (; i + 4 <= frameCount; i += 4)
+  {
+    float left[4] = {0.0f, 0.0f, 0.0f, 0.0f};
+    float right[4] = {0.0f, 0.0f, 0.0f, 0.0f};
+    for (int b = 0; b < busCount; b++)
+    {
+      const float* __restrict pBusLeft = pBuses[b];
+      const float* __restrict pBusRight = pBuses[b] + MIXER_BLOCK_FRAMES;
+      for (int j = 0; j < 4; j++)
+      {
+        left[j] += busGains[b] * pBusLeft[i + j];
+        right[j] += busGains[b] * pBusRight[i + j];
+      }
+    }
+    for (int j = 0; j < 4; j++)
+    {
+      pLeft[i + j] = left[j];
+      pRight[i + j] = right[j];
+    }
+  }
+  for (; i < frameCount; i++)
+  {
+    float left = 0.0f;
+    float right = 0.0f;
+    for (int b = 0; b < busCount; b++)
+    {
+      left += busGains[b] * pBuses[b][i];
+      right += busGains[b] * pBuses[b][i + MIXER_BLOCK_FRAMES];
+    }
+    pLeft[i] = left;
+    pRight[i] = right;
+  }
+}
+
+// mixes every sounding voice into pLeft and pRight, so the cost follows the number of notes playing and not the
+// key count. Voices on the same bus with the same pan are summed in mono and panned into their bus together, so
+// the usual case of many notes sharing a pan costs one pan pass and not one per voice. The buses are then summed
+// with their gains in a single pass that only reads the buses something was mixed into
+void mix_voices(VoicePool* pool, const float* busGains, float* pLeft, float* pRight, ma_uint32 frameCount)
+{
+  bool busUsed[MIX_BUSES] = {};
+  bool voiceMixed[MAX_VOICES] = {};
+  float* voiceSamples = pool->voiceSamples;
+  ma_uint32 paddedCount = (frameCount + 3) & ~3u;
+  OscillatorKernel kernel = oscillatorKernels[pool->waveform];
+  for (int v = 0; v < MAX_VOICES; v++)
+  {
+    const Voice* first = &pool->voices[v];
+    if (!first->active || voiceMixed[v])
+    {
+      continue;
+    }
+
+    memset(voiceSamples, 0, paddedCount * sizeof(float));
+    for (int w = v; w < MAX_VOICES; w++)
+    {
+      Voice* voice = &pool->voices[w];
+      if (voice->active && !voiceMixed[w] && voice->bus == first->bus && voice->panLeft == first->panLeft
+          && voice->panRight == first->panRight)
+      {
+        voiceMixed[w] = true;
+        render_voice(pool, voice, kernel, voiceSamples, frameCount);
+      }
+    }
+
+    // the first group on a bus sets it, so buses never need clearing
+    float* busLeft = pool->busSamples + 2 * first->bus * MIXER_BLOCK_FRAMES;
+    pan_into_bus(voiceSamples, busLeft, busLeft + MIXER_BLOCK_FRAMES, paddedCount, first->panLeft, first->panRight,
+                 busUsed[first->bus]);
+    busUsed[first->bus] = true;
+  }
+
+  const float* usedBuses[MIX_BUSES];
+  float usedGains[MIX_BUSES];
+  int usedCount = 0;
+  for (int b = 0; b < MIX_BUSES; b++)
+  {
+    if (busUsed[b])
+    {
+      usedBuses[usedCount] = pool->busSamples + 2 * b * MIXER_BLOCK_FRAMES;
+      usedGains[usedCount] = busGains[b];
+      usedCount++;
+    }
+  }
+  sum_buses(usedBuses, usedGains, usedCount, pLeft, pRight, frameCount);
+  pool->frame += frameCount;
+}
+
+// the mixer works on up to MIXER_BLOCK_FRAMES at a time, so longer calls are split
+void render_voices(VoicePool* pool, const float* busGains, float* pLeft, float* pRight, ma_uint32 frameCount)
+{
+  for (ma_uint32 framesDone = 0; framesDone < frameCount; framesDone += MIXER_BLOCK_FRAMES)
+  {
+    ma_uint32 framesToMix = std::min(frameCount - framesDone, (ma_uint32) MIXER_BLOCK_FRAMES);
+    mix_voices(pool, busGains, pLeft + framesDone, pRight + framesDone, framesToMix);
+  }
+}
+
+static void update_instrument_select(GtkWidget* widget, gpointer data)
+{
+  int selected = gtk_drop_down_get_selected(GTK_DROP_DOWN(widget));
+  if (selected != selectedWaveform)
+  {
+    g_print("instrument updating...\n");
+    selectedWaveform = selected;
+    push_command(SET_WAVEFORM_COMMAND, oscillator_type_from_selection(selectedWaveform));
+  }
+}
+
+// audio thread state, only changed by apply_command and data_callback
+bool audioPlaying = false;
+ma_uint64 audioPlaybackFrame = 0;
+ma_uint64 audioStartFrame = 0; // where playback last started or was moved to
+ma_uint64 audioEndFrame = 0;   // where the song last played to its end
+gint64 audioEndHeardTime = 0;  // and when that comes out of the speakers
+
+ma_uint64 first_frame_of_column(int column, ma_uint32 sampleRate);
+
+void apply_command(const Command& c)
+{
+  switch (c.type)
+  {
+    case SET_NOTES_COMMAND:
+    {
+      audioNotes = c.notes;
+      audioNotesInUse.store(audioNotes, std::memory_order_release);
+      // edits to the column that is playing should be heard right away
+      voicePool.syncedColumn = -1;
+      break;
+    }
+    case SET_WAVEFORM_COMMAND:
+    {
+      set_voice_pool_waveform(&voicePool, (OscillatorType) c.data1);
+      break;
+    }
+    case SET_PLAYING_COMMAND:
+    {
+      audioPlaying = c.data1;
+      audioStartFrame = audioPlaybackFrame;
+      release_all_voices(&voicePool);
+      break;
+    }
+    case SEEK_COMMAND:
+    {
+      audioPlaybackFrame = first_frame_of_column(c.data1, live_sample_rate());
+      audioStartFrame = audioPlaybackFrame;
+      release_all_voices(&voicePool);
+      break;
+    }
+    case PREVIEW_NOTE_COMMAND:
+    {
+      for (int v = 0; v < MAX_VOICES; v++)
+      {
+        Voice* voice = &voicePool.voices[v];
+        if (voice->active && !voice->releasing && voice->noteStart == PREVIEW_NOTE_START)
+        {
+          release_voice(&voicePool, voice);
+        }
+      }
+      if (c.data2 && c.data1 >= 0 && c.data1 < pianoKeyCount)
+      {
+        note_on(&voicePool, c.data1, PREVIEW_NOTE_START, 1.0f, c.value, c.data3);
+      }
+      break;
+    }
+    default:
+      break;
+  }
+}
+
+// the grid column that is playing at the given frame of the song
+int column_at_frame(ma_uint64 frame, ma_uint32 sampleRate)
+{
+  return (int) ((double) frame / sampleRate * tempo);
+}
+
+// the first frame of the song where the given column is playing
+ma_uint64 first_frame_of_column(int column, ma_uint32 sampleRate)
+{
+  ma_uint64 frame = (ma_uint64) std::ceil(column / tempo * sampleRate);
+  // the estimate can be off by a frame from rounding, so nudge it until it agrees with column_at_frame
+  while (frame > 0 && column_at_frame(frame - 1, sampleRate) >= column)
+  {
+    frame--;
+  }
+  while (column_at_frame(frame, sampleRate) < column)
+  {
+    frame++;
+  }
+  return frame;
+}
+
+ma_uint64 song_length_in_frames(ma_uint32 sampleRate)
+{
+  return (ma_uint64) ((double)pianoGridWidth / tempo * sampleRate);
+}
+
+// plays the notes of column into pOutput
+void render_column(float* pLeft, float* pRight, ma_uint32 frameCount, int column, const NoteStore* song, VoicePool* pool)
+{
+  if (column != pool->syncedColumn)
+  {
+    sync_voices_to_column(pool, song, column);
+  }
+  render_voices(pool, song->busGains, pLeft, pRight, frameCount);
+}
+
+// renders frameCount frames of the song starting at startFrame, splitting the work wherever the column changes
+void render_song_frames(float* pLeft, float* pRight, ma_uint64 startFrame, ma_uint32 frameCount, ma_uint32 sampleRate,
+                        const NoteStore* song, VoicePool* pool)
+{
+  ma_uint32 framesDone = 0;
+  while (framesDone < frameCount)
+  {
+    ma_uint64 frame = startFrame + framesDone;
+    int column = column_at_frame(frame, sampleRate);
+    ma_uint64 columnEnd = first_frame_of_column(column + 1, sampleRate);
+    ma_uint32 framesInColumn = frameCount - framesDone;
+    if (columnEnd - frame < framesInColumn)
+    {
+      framesInColumn = (ma_uint32) (columnEnd - frame);
+    }
+    render_column(pLeft + framesDone, pRight + framesDone, framesInColumn, column, song, pool);
+    framesDone += framesInColumn;
+  }
+}
+
+// moves the pool on to startFrame, leaving it exactly the way playing the song up to there would have, without
+// rendering anything. Only the note ons and offs of the columns in between are replayed, since phase and gain
+// follow from the frame. The pool has to be new or have just finished rendering song frames before startFrame
+void preroll_voices(VoicePool* pool, const NoteStore* song, ma_uint64 startFrame)
+{
+  int firstColumn = column_at_frame(pool->frame, pool->sampleRate);
+  int lastColumn = column_at_frame(startFrame, pool->sampleRate);
+  ma_uint64 columnStart = first_frame_of_column(firstColumn, pool->sampleRate);
+  for (int column = firstColumn; column <= lastColumn; column++)
+  {
+    ma_uint64 nextColumnStart = first_frame_of_column(column + 1, pool->sampleRate);
+    // a column shorter than a frame is never played, so it never gets synced either
+    if (nextColumnStart > columnStart && column != pool->syncedColumn)
+    {
+      pool->frame = columnStart;
+      expire_voices(pool);
+      sync_voices_to_column(pool, song, column);
+    }
+    columnStart = nextColumnStart;
+  }
+  pool->frame = startFrame;
+  expire_voices(pool);
+}
+
+// plays the next frameCount frames of the live song into pOutput and moves the sequencer clock along
+void render_live_frames(float* pLeft, float* pRight, ma_uint32 frameCount, ma_uint32 sampleRate)
+{
+  ma_uint32 framesPlayed = 0;
+
+	if (audioPlaying)
+	{
+    // g_print("playing\n"); 
+    // g_printf("playback frame = %llu\n", audioPlaybackFrame);
+
+    // the column changes at the exact frame the tempo says it should, even in the middle of this buffer
+    ma_uint64 songFrames = song_length_in_frames(sampleRate);
+    ma_uint32 framesToPlay = 0;
+    if (audioPlaybackFrame < songFrames)
+    {
+      framesToPlay = frameCount;
+      if (songFrames - audioPlaybackFrame < framesToPlay)
+      {
+        framesToPlay = (ma_uint32) (songFrames - audioPlaybackFrame);
+      }
+    }
+    render_song_frames(pLeft, pRight, audioPlaybackFrame, framesToPlay, sampleRate, audioNotes, &voicePool);
+    framesPlayed = framesToPlay;
+
+    audioPlaybackFrame += framesToPlay;
+    if (audioPlaybackFrame >= songFrames)
+    {
+      // finished the song, so stop and go back to the start like the reset button does
+      audioPlaying = false;
+      audioPlaybackFrame = 0;
+      audioStartFrame = 0;
+      release_all_voices(&voicePool);
+      playbackEndCount.fetch_add(1, std::memory_order_release);
+    }
+	}
+
+  // the rest of the buffer is the note being edited and the tails of released voices
+  render_voices(&voicePool, audioNotes->busGains, pLeft + framesPlayed, pRight + framesPlayed, frameCount - framesPlayed);
+}
+
+// callback timing, written only by the audio thread and read by the gtk thread without locks.
+// load is the time a callback took divided by the time the audio it produced lasts, in permille
+struct CallbackStats
+{
+  std::atomic<ma_uint64> callbacks;
+  std::atomic<ma_uint64> overruns;      // callbacks that took longer than their own period budget
+  std::atomic<ma_uint64> underruns;     // callbacks that came so late the device must have run out of audio
+  std::atomic<ma_uint32> load;          // of the last callback
+  std::atomic<ma_uint32> peakLoad;      // since the meter last looked
+  std::atomic<ma_uint32> maxLoad;       // since the device started
+  std::atomic<ma_uint64> histogram[LOAD_HISTOGRAM_BUCKETS];
+};
+
+CallbackStats callbackStats;
+
+// audio thread only
+std::chrono::steady_clock::time_point previousCallbackStart;
+bool hadPreviousCallback = false;
+
+// how much audio the device holds: internalPeriods periods
+double device_buffer_seconds(ma_device* pDevice)
+{
+  ma_uint32 bufferFrames = pDevice->playback.internalPeriodSizeInFrames * std::max(pDevice->playback.internalPeriods, (ma_uint32) 1);
+  ma_uint32 rate = pDevice->playback.internalSampleRate ? pDevice->playback.internalSampleRate : pDevice->sampleRate;
+  return (double) bufferFrames / rate;
+}
+
+// miniaudio doesn't tell us when the backend underruns, so guess it: if the gap since the last callback
+// is longer than the device's buffer lasts, the buffer has run dry at some point in between
+bool callback_was_late(ma_device* pDevice, std::chrono::steady_clock::time_point start)
+{
+  bool late = false;
+  if (hadPreviousCallback)
+  {
+    double gap = std::chrono::duration<double>(start - previousCallbackStart).count();
+    double bufferSeconds = device_buffer_seconds(pDevice);
+    late = bufferSeconds > 0 && gap > bufferSeconds;
+  }
+  previousCallbackStart = start;
+  hadPreviousCallback = true;
+  return late;
+}
+
+void record_callback(ma_uint32 frameCount, ma_uint32 sampleRate, double seconds, bool late)
+{
+  double budget = (double) frameCount / sampleRate;
+  double load = budget > 0 ? seconds / budget : 0;
+  ma_uint32 loadPermille = (ma_uint32) std::min(load * 1000.0, 4294967295.0);
+
+  int bucket = std::min((int) (load / LOAD_HISTOGRAM_STEP), LOAD_HISTOGRAM_BUCKETS - 1);
+  callbackStats.histogram[bucket].fetch_add(1, std::memory_order_relaxed);
+  callbackStats.callbacks.fetch_add(1, std::memory_order_relaxed);
+  if (load > 1.0)
+  {
+    callbackStats.overruns.fetch_add(1, std::memory_order_relaxed);
+  }
+  if (late)
+  {
+    callbackStats.underruns.fetch_add(1, std::memory_order_relaxed);
+  }
+
+  callbackStats.load.store(loadPermille, std::memory_order_relaxed);
+  // the meter resets peakLoad with an exchange, losing one peak to that race is fine
+  if (loadPermille > callbackStats.peakLoad.load(std::memory_order_relaxed))
+  {
+    callbackStats.peakLoad.store(loadPermille, std::memory_order_relaxed);
+  }
+  if (loadPermille > callbackStats.maxLoad.load(std::memory_order_relaxed))
+  {
+    callbackStats.maxLoad.store(loadPermille, std::memory_order_relaxed);
+  }
+}
+
+static gboolean update_load_meter(gpointer data)
+{
+  GtkLabel* meter = GTK_LABEL(data);
+  ma_uint32 load = callbackStats.load.load(std::memory_order_relaxed);
+  ma_uint32 peak = callbackStats.peakLoad.exchange(0, std::memory_order_relaxed);
+  char text[128];
+  g_snprintf(text, sizeof(text), "DSP %3u%% (peak %3u%%)  overruns %llu  underruns %llu",
+             load / 10, peak / 10,
+             (unsigned long long) callbackStats.overruns.load(std::memory_order_relaxed),
+             (unsigned long long) callbackStats.underruns.load(std::memory_order_relaxed));
+  gtk_label_set_text(meter, text);
+  return G_SOURCE_CONTINUE;
+}
+
+void print_callback_stats()
+{
+  ma_uint64 callbacks = callbackStats.callbacks.load(std::memory_order_relaxed);
+  g_print("audio callbacks: %llu, overruns: %llu, underruns (estimated): %llu, max load: %.1f%%\n",
+          (unsigned long long) callbacks,
+          (unsigned long long) callbackStats.overruns.load(std::memory_order_relaxed),
+          (unsigned long long) callbackStats.underruns.load(std::memory_order_relaxed),
+          callbackStats.maxLoad.load(std::memory_order_relaxed) / 10.0);
+  if (callbacks == 0)
+  {
+    return;
+  }
+  for (int i = 0; i < LOAD_HISTOGRAM_BUCKETS; i++)
+  {
+    ma_uint64 count = callbackStats.histogram[i].load(std::memory_order_relaxed);
+    int from = (int) (i * LOAD_HISTOGRAM_STEP * 100 + 0.5);
+    int to = (int) ((i + 1) * LOAD_HISTOGRAM_STEP * 100 + 0.5);
+    if (i == LOAD_HISTOGRAM_BUCKETS - 1)
+    {
+      g_print("  %4d%% +     : %llu\n", from, (unsigned long long) count);
+    }
+    else
+    {
+      g_print("  %4d-%4d%% : %llu\n", from, to, (unsigned long long) count);
+    }
+  }
+}
+
+void data_callback(ma_device* pDevice, void* pOutput, const void* pInput, ma_uint32 frameCount)
+{
+  std::chrono::steady_clock::time_point callbackStart = std::chrono::steady_clock::now();
+  gint64 callbackTime = g_get_monotonic_time(); // the clock gtk's frame clock uses
+  bool late = callback_was_late(pDevice, callbackStart);
+
+  Command command;
+  while (pop_command(&command))
+  {
+    apply_command(command);
+  }
+
+  // what we are about to render is heard once the device has played out everything it already holds,
+  // which is about its whole buffer
+  PlaybackSnapshot snapshot;
+  snapshot.frame = audioPlaybackFrame;
+  snapshot.column = column_at_frame(audioPlaybackFrame, live_sample_rate());
+  snapshot.heardTime = callbackTime + (gint64) (device_buffer_seconds(pDevice) * 1000000);
+  snapshot.frameCount = frameCount * liveOversampling;
+  snapshot.startFrame = audioStartFrame;
+  snapshot.playing = audioPlaying;
+
+  // In playback mode copy data to pOutput. In capture mode read data from pInput. In full-duplex mode, both
+  // pOutput and pInput will be valid and you can move data from pInput into pOutput. Never process more than
+  // frameCount frames.
+
+  // the voices mix into the preallocated bus, one bus worth at a time, so a big period from the device
+  // never means a big buffer here
+  float* pOutputF32 = (float*)pOutput;
+  ma_uint32 channels = pDevice->playback.channels;
+  ma_uint32 framesDone = 0;
+  while (framesDone < frameCount)
+  {
+    ma_uint32 framesToRender = std::min(frameCount - framesDone, deviceBus.capacity);
+    render_live_frames(mix_bus_channel(&oversampledDeviceBus, 0), mix_bus_channel(&oversampledDeviceBus, 1),
+                       framesToRender * liveOversampling, live_sample_rate());
+    for (int c = 0; c < 2; c++)
+    {
+      downsample(&deviceOversamplers[c], mix_bus_channel(&oversampledDeviceBus, c), framesToRender,
+                 mix_bus_channel(&deviceBus, c));
+    }
+    const float* pLeft = mix_bus_channel(&deviceBus, 0);
+    const float* pRight = mix_bus_channel(&deviceBus, 1);
+    float* pFrames = pOutputF32 + framesDone * channels;
+    if (channels == 1)
+    {
+      for (ma_uint32 i = 0; i < framesToRender; i++)
+      {
+        pFrames[i] = (pLeft[i] + pRight[i]) * 0.5f;
+      }
+    }
+    else
+    {
+      for (ma_uint32 i = 0; i < framesToRender; i++)
+      {
+        for (ma_uint32 c = 0; c < channels; c++)
+        {
+          pFrames[i * channels + c] = c % 2 == 0 ? pLeft[i] : pRight[i];
+        }
+      }
+    }
+    framesDone += framesToRender;
+  }
+  if (snapshot.playing && !audioPlaying)
+  {
+    // the song ran out somewhere in this buffer, which is heard from snapshot.heardTime on
+    audioEndFrame = song_length_in_frames(live_sample_rate());
+    audioEndHeardTime = snapshot.heardTime + (gint64) ((audioEndFrame - snapshot.frame) * 1000000.0 / live_sample_rate());
+  }
+  snapshot.endFrame = audioEndFrame;
+  snapshot.endHeardTime = audioEndHeardTime;
+  publish_playback(snapshot);
+
+  double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - callbackStart).count();
+  record_callback(frameCount, pDevice->sampleRate, seconds, late);
+
+	(void)pInput;   /* Unused. */    
+}
+
+
+
+// song files (.ssy) are plain text, one setting or note per line:
+//   silly_synth_song 2
+//   tempo 8
+//   keys 25
+//   columns 32
+//   base_key 48
+//   waveform sine
+//   bus_gain <bus> <gain>
+//   note <start column> <length in columns> <key> <velocity> <pan> <bus>
+// blank lines and lines starting with # are ignored. Version 1 files have no bus gains, and notes without pan
+// and bus, which are centred on bus 0
+#define SONG_FILE_HEADER  "silly_synth_song"
+#define SONG_FILE_VERSION 2
+
+bool save_song(const char* path, const NoteStore* song, OscillatorType waveform)
+{
+  FILE* file = fopen(path, "w");
+  if (file == NULL)
+  {
+    g_print("could not open %s for writing\n", path);
+    return false;
+  }
+  fprintf(file, "%s %i\n", SONG_FILE_HEADER, SONG_FILE_VERSION);
+  fprintf(file, "tempo %.17g\n", tempo);
+  fprintf(file, "keys %i\n", pianoKeyCount);
+  fprintf(file, "columns %i\n", pianoGridWidth);
+  fprintf(file, "base_key %i\n", baseKeyNote);
+  fprintf(file, "waveform %s\n", oscillatorTypeNames[waveform]);
+  for (int b = 0; b < MIX_BUSES; b++)
+  {
+    fprintf(file, "bus_gain %i %.9g\n", b, song->busGains[b]);
+  }
+  for (const NoteEvent& e : get_store_notes(song))
+  {
+    fprintf(file, "note %i %i %i %.9g %.9g %i\n", e.start, e.length, e.key, e.velocity, e.pan, e.bus);
+  }
+  bool ok = ferror(file) == 0;
+  ok = fclose(file) == 0 && ok;
+  if (!ok)
+  {
+    g_print("encountered an error while writing %s\n", path);
+  }
+  return ok;
+}
+
+// replaces the song settings and song with the contents of the file. Nothing is changed if the file is bad
+bool load_song(const char* path, NoteStore* song, OscillatorType* waveform)
+{
+  FILE* file = fopen(path, "r");
+  if (file == NULL)
+  {
+    g_print("could not open %s\n", path);
+    return false;
+  }
+
+  double fileTempo = tempo;
+  int fileKeys = pianoKeyCount;
+  int fileColumns = pianoGridWidth;
+  int fileBaseKey = baseKeyNote;
+  OscillatorType fileWaveform = *waveform;
+  vector<NoteEvent> events;
+  float fileBusGains[MIX_BUSES];
+  for (int b = 0; b < MIX_BUSES; b++)
+  {
+    fileBusGains[b] = 1.0f;
+  }
+
+  char line[256];
+  int lineNumber = 0;
+  bool ok = true;
+  bool sawHeader = false;
+  while (ok && fgets(line, sizeof(line), file) != NULL)
+  {
+    lineNumber++;
+    char word[64];
+    if (sscanf(line, "%63s", word) != 1 || word[0] == '#')
+    {
+      continue;
+    }
+
+    if (!sawHeader)
+    {
+      int version = 0;
+      ok = sscanf(line, SONG_FILE_HEADER " %i", &version) == 1 && version >= 1 && version <= SONG_FILE_VERSION;
+      sawHeader = true;
+    }
+    else if (strcmp(word, "tempo") == 0)
+    {
+      ok = sscanf(line, "%*s %lf", &fileTempo) == 1 && fileTempo > 0;
+    }
+    else if (strcmp(word, "keys") == 0)
+    {
+      ok = sscanf(line, "%*s %i", &fileKeys) == 1 && fileKeys > 0 && fileKeys <= MAX_PIANO_KEYS;
+    }
+    else if (strcmp(word, "columns") == 0)
+    {
+      ok = sscanf(line, "%*s %i", &fileColumns) == 1 && fileColumns > 0;
+    }
+    else if (strcmp(word, "base_key") == 0)
+    {
+      ok = sscanf(line, "%*s %i", &fileBaseKey) == 1;
+    }
+    else if (strcmp(word, "waveform") == 0)
+    {
+      char name[64];
+      ok = sscanf(line, "%*s %63s", name) == 1;
+      int type = 0;
+      while (ok && type < OSCILLATOR_TYPE_COUNT && strcmp(name, oscillatorTypeNames[type]) != 0)
+      {
+        type++;
+      }
+      ok = ok && type < OSCILLATOR_TYPE_COUNT;
+      fileWaveform = (OscillatorType) (ok ? type : 0);
+    }
+    else if (strcmp(word, "bus_gain") == 0)
+    {
+      int bus = 0;
+      float gain = 0.0f;
+      ok = sscanf(line, "%*s %i %f", &bus, &gain) == 2 && bus >= 0 && bus < MIX_BUSES && gain >= 0;
+      if (ok)
+      {
+        fileBusGains[bus] = gain;
+      }
+    }
+    else if (strcmp(word, "note") == 0)
+    {
+      NoteEvent e;
+      e.pan = 0.0f;
+      e.bus = 0;
+      int fields = sscanf(line, "%*s %i %i %i %f %f %i", &e.start, &e.length, &e.key, &e.velocity, &e.pan, &e.bus);
+      ok = (fields == 4 || fields == 6) && e.start >= 0 && e.length > 0 && e.velocity >= 0
+           && e.pan >= -1 && e.pan <= 1 && e.bus >= 0 && e.bus < MIX_BUSES;
+      events.push_back(e);
+    }
+    else
+    {
+      ok = false;
+    }
+  }
+  ok = ok && sawHeader && ferror(file) == 0;
+  fclose(file);
+  if (!ok)
+  {
+    g_print("%s:%i: not a valid song file\n", path, lineNumber);
+    return false;
+  }
+
+  // the notes have to fit the grid, and a key can only play one note at a time
+  std::sort(events.begin(), events.end(), note_before);
+  vector<int> keyEnds(fileKeys, 0);
+  for (const NoteEvent& e : events)
+  {
+    if (e.key < 0 || e.key >= fileKeys || note_end(e) > fileColumns || e.start < keyEnds[e.key])
+    {
+      g_print("%s: note at column %i on key %i doesn't fit the song\n", path, e.start, e.key);
+      return false;
+    }
+    keyEnds[e.key] = note_end(e);
+  }
+
+  tempo = fileTempo;
+  pianoKeyCount = fileKeys;
+  pianoGridWidth = fileColumns;
+  baseKeyNote = fileBaseKey;
+  *waveform = fileWaveform;
+  set_store_notes(song, events);
+  for (int b = 0; b < MIX_BUSES; b++)
+  {
+    song->busGains[b] = fileBusGains[b];
+  }
+  return true;
+}
+
+// a streaming polyphase windowed-sinc resampler for rational ratios (up / down, reduced), for exporting at
+// another rate than the song is rendered at. Output frame n lands n * down / up input frames into the input, and
+// is the dot product of the taps inputs around there with the filter for the fractional part. The filters are
+// a kaiser windowed sinc, one per fraction, so no coefficients are worked out while running, and memory stays
+// at one filter bank plus taps + RESAMPLER_BLOCK_FRAMES samples of input
+enum ResamplerQuality
+{
+  RESAMPLER_FAST,
+  RESAMPLER_MEDIUM,
+  RESAMPLER_BEST
+};
+
+const char* resamplerQualityNames[] = {"fast", "medium", "best"};
+// taps per filter, kaiser beta and cutoff (as a share of the lower of the two nyquist frequencies) per quality
+const int resamplerTaps[] = {16, 32, 64};
+const double resamplerBeta[] = {6.0, 8.5, 11.0};
+const double resamplerCutoff[] = {0.86, 0.92, 0.96};
+
+struct Resampler
+{
+  ma_uint32 up;
+  ma_uint32 down;
+  int taps;
+  float* filters;            // up filters of taps coefficients, filter p is for outputs p / up past an input frame
+  float* buffer;             // input that is still needed, buffer[0] is input frame bufferStart
+  int bufferCapacity;
+  int bufferFrames;
+  ma_int64 bufferStart;
+  ma_uint64 outputFrames;    // made so far
+};
+
+ResamplerQuality resamplerQuality = RESAMPLER_MEDIUM;
+
+void init_resampler(Resampler* r, ma_uint32 inputRate, ma_uint32 outputRate, ResamplerQuality quality)
+{
+  ma_uint32 a = inputRate;
+  ma_uint32 b = outputRate;
+  while (b != 0)
+  {
+    ma_uint32 t = a % b;
+    a = b;
+    b = t;
+  }
+  r->up = outputRate / a;
+  r->down = inputRate / a;
+  r->taps = resamplerTaps[quality];
+
+  double cutoff = resamplerCutoff[quality] * std::min(1.0, (double) r->up / r->down);
+  double beta = resamplerBeta[quality];
+  double half = r->taps / 2;
+  r->filters = (float*) ma_aligned_malloc(r->up * r->taps * sizeof(float), MIX_BUS_ALIGNMENT, NULL);
+  for (ma_uint32 p = 0; p < r->up; p++)
+  {
+    float* filter = r->filters + p * r->taps;
+    double sum = 0.0;
+    for (int k = 0; k < r->taps; k++)
+    {
+      // how far this tap is from the output, in input frames
+      double d = k - half + 1 - (double) p / r->up;
+      double x = M_PI * cutoff * d;
+      double sinc = d == 0.0 ? 1.0 : std::sin(x) / x;
+      double w = d / half;
+      double window = std::fabs(w) < 1.0 ? bessel_i0(beta * std::sqrt(1.0 - w * w)) / bessel_i0(beta) : 0.0;
+      filter[k] = (float) (sinc * window);
+      sum += filter[k];
+    }
+    // every filter passes dc at exactly unity gain
+    for (int k = 0; k < r->taps; k++)
+    {
+      filter[k] = (float) (filter[k] / sum);
+    }
+  }
+
+  // start with silence before the first input, so the first outputs have something to look back at
+  r->bufferCapacity = r->taps + RESAMPLER_BLOCK_FRAMES;
+  r->buffer = (float*) ma_aligned_malloc(r->bufferCapacity * sizeof(float), MIX_BUS_ALIGNMENT, NULL);
+  r->bufferFrames = r->taps / 2 - 1;
+  r->bufferStart = -r->bufferFrames;
+  for (int i = 0; i < r->bufferFrames; i++)
+  {
+    r->buffer[i] = 0.0f;
+  }
+  r->outputFrames = 0;
+}
+
+void uninit_resampler(Resampler* r)
+{
+  ma_aligned_free(r->filters, NULL);
+  ma_aligned_free(r->buffer, NULL);
+}
+
+// room pOutput needs for the output of frameCount input frames
+ma_uint32 resampler_max_output(const Resampler* r, ma_uint32 frameCount)
+{
+  return (ma_uint32) ((ma_uint64) frameCount * r->up / r->down + 2);
+}
+
+// makes every output frame the buffered input is enough for, then drops the input no later output needs
+ma_uint32 resample_buffered(Resampler* r, float* pOutput)
+{
+  int half = r->taps / 2;
+  ma_int64 bufferEnd = r->bufferStart + r->bufferFrames;
+  ma_uint32 framesOut = 0;
+  while (true)
+  {
+    ma_uint64 position = r->outputFrames * r->down;
+    ma_int64 frame = (ma_int64) (position / r->up);
+    if (frame + half >= bufferEnd)
+    {
+      break;
+    }
+    const float* filter = r->filters + (position % r->up) * r->taps;
+    pOutput[framesOut++] = firKernel(filter, r->buffer + (frame - half + 1 - r->bufferStart), r->taps);
+    r->outputFrames++;
+  }
+
+  ma_int64 nextFirst = (ma_int64) (r->outputFrames * r->down / r->up) - half + 1;
+  int drop = (int) std::min(std::max(nextFirst - r->bufferStart, (ma_int64) 0), (ma_int64) r->bufferFrames);
+  memmove(r->buffer, r->buffer + drop, (r->bufferFrames - drop) * sizeof(float));
+  r->bufferFrames -= drop;
+  r->bufferStart += drop;
+  return framesOut;
+}
+
+// feeds frameCount input frames through and writes the output frames they finish to pOutput, which needs
+// resampler_max_output(frameCount) frames of room. Returns how many were written
+ma_uint32 resample(Resampler* r, const float* pInput, ma_uint32 frameCount, float* pOutput)
+{
+  ma_uint32 framesIn = 0;
+  ma_uint32 framesOut = 0;
+  while (framesIn < frameCount)
+  {
+    int framesToCopy = (int) std::min(frameCount - framesIn, (ma_uint32) (r->bufferCapacity - r->bufferFrames));
+    memcpy(r->buffer + r->bufferFrames, pInput + framesIn, framesToCopy * sizeof(float));
+    r->bufferFrames += framesToCopy;
+    framesIn += framesToCopy;
+    framesOut += resample_buffered(r, pOutput + framesOut);
+  }
+  return framesOut;
+}
+
+int exportThreadCount = 0; // 0 renders on every core, 1 renders on the calling thread only
+// the rate songs are rendered at before being resampled to exportSampleRate, 0 renders at exportSampleRate
+ma_uint32 exportRenderSampleRate = 0;
+int exportOversampling = 1; // 1, 2 or 4 times the render rate the synth runs at before being decimated to it
+
+// lets another thread follow an export and stop it early
+struct ExportProgress
+{
+  std::atomic<ma_uint64> framesDone;
+  std::atomic<ma_uint64> totalFrames;
+  std::atomic<bool> cancelled;
+};
+
+// renders frames [startFrame, startFrame + frameCount) of the song block for block the way the serial export does,
+// so the samples come out exactly the same. startFrame has to be on the EXPORT_BLOCK_FRAMES grid, and the pool
+// can't be past it yet
+void render_song_segment(float* pLeft, float* pRight, ma_uint64 startFrame, ma_uint64 frameCount, const NoteStore* song,
+                         VoicePool* pool)
+{
+  preroll_voices(pool, song, startFrame);
+  for (ma_uint64 framesDone = 0; framesDone < frameCount; framesDone += EXPORT_BLOCK_FRAMES)
+  {
+    ma_uint32 blockLength = (ma_uint32) std::min(frameCount - framesDone, (ma_uint64) EXPORT_BLOCK_FRAMES);
+    render_song_frames(pLeft + framesDone, pRight + framesDone, startFrame + framesDone, blockLength, pool->sampleRate,
+                       song, pool);
+  }
+}
+
+// the encoder runs on a thread of its own and is fed from a bounded set of big buffers, so rendering only waits
+// on the disk when every buffer is full, and the disk only waits on rendering when none is. Each buffer holds one
+// segment of the song. Segments can be filled in any order by any number of threads but are written in order
+struct ExportWriter
+{
+  ma_encoder* encoder;
+  ExportProgress* progress;
+  int segmentCount;
+  vector<MixBus> buffers;
+  vector<int> bufferSegments;       // the segment a buffer is being filled with, -1 while it is free
+  vector<ma_uint32> bufferFrames;   // frames in the buffer once it is filled, 0 until then
+  int nextSegment;                  // next segment handed out to be rendered
+  int writtenSegments;
+  ma_uint64 framesWritten;
+  bool stop;                        // the encoder failed or the export was cancelled, so everyone gives up
+  ma_uint32 renderSampleRate;
+  // when the song is rendered at another rate, the buffers hold float at renderSampleRate (exportChannels channels
+  // one after the other), and this thread resamples and converts them on their way to the encoder
+  Resampler* resampler;             // one per channel
+  MixBus resampled;
+  MixBus converted;
+  ma_uint64 totalFrames;            // frames the finished file has
+  std::mutex lock;
+  std::condition_variable changed;
+  std::thread thread;
+};
+
+ma_uint64 export_segment_frames()
+{
+  return (ma_uint64) EXPORT_SEGMENT_BLOCKS * EXPORT_BLOCK_FRAMES;
+}
+
+bool export_cancelled(ExportWriter* writer)
+{
+  return writer->progress != NULL && writer->progress->cancelled.load(std::memory_order_relaxed);
+}
+
+// waits for a free buffer and hands it out along with the next segment to render into it.
+// False once every segment has been handed out or the export has stopped
+bool acquire_export_buffer(ExportWriter* writer, int* buffer, int* segment)
+{
+  std::unique_lock<std::mutex> guard(writer->lock);
+  while (true)
+  {
+    if (!writer->stop && export_cancelled(writer))
+    {
+      writer->stop = true;
+      writer->changed.notify_all();
+    }
+    if (writer->stop || writer->nextSegment >= writer->segmentCount)
+    {
+      return false;
+    }
+    for (int b = 0; b < (int) writer->buffers.size(); b++)
+    {
+      if (writer->bufferSegments[b] == -1)
+      {
+        *buffer = b;
+        *segment = writer->nextSegment++;
+        writer->bufferSegments[b] = *segment;
+        writer->bufferFrames[b] = 0;
+        return true;
+      }
+    }
+    writer->changed.wait(guard);
+  }
+}
+
+void submit_export_buffer(ExportWriter* writer, int buffer, ma_uint32 frameCount)
+{
+  std::lock_guard<std::mutex> guard(writer->lock);
+  writer->bufferFrames[buffer] = frameCount;
+  writer->changed.notify_all();
+}
+
+void convert_export_frames(void* pOutput, const float* pLeft, const float* pRight, ma_uint64 frameCount);
+
+// frames already in the export format, never more than the file should hold
+bool write_export_frames(ExportWriter* writer, const void* pFrames, ma_uint64 frameCount)
+{
+  frameCount = std::min(frameCount, writer->totalFrames - writer->framesWritten);
+  ma_uint64 framesWritten = 0;
+  ma_result result = ma_encoder_write_pcm_frames(writer->encoder, pFrames, frameCount, &framesWritten);
+  writer->framesWritten += framesWritten;
+  return result == MA_SUCCESS && framesWritten == frameCount;
+}
+
+// float at the render rate, channel c starting at pInput + c * channelStride, resampled a block at a time so the
+// output buffers stay small. Every channel's resampler is in the same place, so they all make the same frames
+bool write_resampled_frames(ExportWriter* writer, const float* pInput, ma_uint64 channelStride, ma_uint64 frameCount)
+{
+  for (ma_uint64 framesDone = 0; framesDone < frameCount; framesDone += RESAMPLER_BLOCK_FRAMES)
+  {
+    ma_uint32 framesIn = (ma_uint32) std::min(frameCount - framesDone, (ma_uint64) RESAMPLER_BLOCK_FRAMES);
+    ma_uint32 framesOut = 0;
+    for (ma_uint32 c = 0; c < exportChannels; c++)
+    {
+      framesOut = resample(&writer->resampler[c], pInput + c * channelStride + framesDone, framesIn,
+                           mix_bus_channel(&writer->resampled, c));
+    }
+    const float* pLeft = mix_bus_channel(&writer->resampled, 0);
+    convert_export_frames(writer->converted.samples, pLeft, exportChannels == 2 ? mix_bus_channel(&writer->resampled, 1) : pLeft,
+                          framesOut);
+    if (!write_export_frames(writer, writer->converted.samples, framesOut))
+    {
+      return false;
+    }
+  }
+  return true;
+}
+
+// the last output frames need input from past the end of the song, which is silence
+bool flush_resampler(ExportWriter* writer)
+{
+  float silence[RESAMPLER_BLOCK_FRAMES] = {};
+  while (writer->framesWritten < writer->totalFrames)
+  {
+    if (!write_resampled_frames(writer, silence, 0, RESAMPLER_BLOCK_FRAMES))
+    {
+      return false;
+    }
+  }
+  return true;
+}
+
+void export_writer_thread(ExportWriter* writer)
+{
+  std::unique_lock<std::mutex> guard(writer->lock);
+  while (writer->writtenSegments < writer->segmentCount)
+  {
+    int buffer = -1;
+    for (int b = 0; b < (int) writer->buffers.size(); b++)
+    {
+      if (writer->bufferSegments[b] == writer->writtenSegments && writer->bufferFrames[b] > 0)
+      {
+        buffer = b;
+      }
+    }
+    if (writer->stop)
+    {
+      return;
+    }
+    if (buffer == -1)
+    {
+      writer->changed.wait(guard);
+      continue;
+    }
+
+    // the buffer belongs to this thread until it is handed back, so the encoder runs without the lock
+    guard.unlock();
+    bool ok;
+    if (writer->resampler != NULL)
+    {
+      ok = write_resampled_frames(writer, writer->buffers[buffer].samples, export_segment_frames(),
+                                  writer->bufferFrames[buffer]);
+    }
+    else
+    {
+      ok = write_export_frames(writer, writer->buffers[buffer].samples, writer->bufferFrames[buffer]);
+    }
+    if (ok && writer->resampler != NULL && writer->writtenSegments + 1 == writer->segmentCount)
+    {
+      ok = flush_resampler(writer);
+    }
+    guard.lock();
+
+    if (writer->progress != NULL)
+    {
+      writer->progress->framesDone.store(writer->framesWritten, std::memory_order_relaxed);
+    }
+    if (!ok)
+    {
+      g_print("encountered an error while exporting\n");
+      writer->stop = true;
+    }
+    writer->bufferSegments[buffer] = -1;
+    writer->writtenSegments++;
+    writer->changed.notify_all();
+  }
+}
+
+void start_export_writer(ExportWriter* writer, ma_encoder* encoder, ExportProgress* progress, ma_uint32 renderSampleRate,
+                         int bufferCount)
+{
+  writer->encoder = encoder;
+  writer->progress = progress;
+  writer->renderSampleRate = renderSampleRate;
+  writer->totalFrames = song_length_in_frames(exportSampleRate);
+  writer->resampler = NULL;
+  if (renderSampleRate != exportSampleRate)
+  {
+    writer->resampler = new Resampler[exportChannels];
+    for (ma_uint32 c = 0; c < exportChannels; c++)
+    {
+      init_resampler(&writer->resampler[c], renderSampleRate, exportSampleRate, resamplerQuality);
+    }
+    ma_uint32 maxFrames = resampler_max_output(writer->resampler, RESAMPLER_BLOCK_FRAMES);
+    init_mix_bus(&writer->resampled, maxFrames, exportChannels);
+    init_mix_bus(&writer->converted, maxFrames * exportChannels);
+  }
+  ma_uint64 renderFrames = song_length_in_frames(renderSampleRate);
+  writer->segmentCount = (int) ((renderFrames + export_segment_frames() - 1) / export_segment_frames());
+  writer->buffers.resize(std::max(std::min(bufferCount, writer->segmentCount), 1));
+  // sized for float samples, which is as big as any export format gets
+  for (MixBus& buffer : writer->buffers)
+  {
+    init_mix_bus(&buffer, (ma_uint32) export_segment_frames() * exportChannels);
+  }
+  writer->bufferSegments.assign(writer->buffers.size(), -1);
+  writer->bufferFrames.assign(writer->buffers.size(), 0);
+  writer->nextSegment = 0;
+  writer->writtenSegments = 0;
+  writer->framesWritten = 0;
+  writer->stop = false;
+  writer->thread = std::thread(export_writer_thread, writer);
+}
+
+// waits for everything handed out to be written. False if the export stopped early
+bool finish_export_writer(ExportWriter* writer)
+{
+  writer->thread.join();
+  for (MixBus& buffer : writer->buffers)
   {
-    double keyWidth = (double) (width - 2 * pianoRollBorder) / pianoGridWidth;
-    double xd = (x - pianoRollBorder) / keyWidth;
-    double keyHeight = (double) (height - 2 * pianoRollBorder) / pianoKeyCount;
-    double yd = (height - y - pianoRollBorder) / keyHeight;
-    if ((int) xd != editX || (int) yd != editY )
+    uninit_mix_bus(&buffer);
+  }
+  if (writer->resampler != NULL)
+  {
+    for (ma_uint32 c = 0; c < exportChannels; c++)
     {
-      // g_printf("xd: %f, yd: %f\n", xd, yd);
-      editX = (int) xd;
-      editY = (int) yd;
-      toggle_note((int) xd, (int) yd);
+      uninit_resampler(&writer->resampler[c]);
+    }
+    delete[] writer->resampler;
+    uninit_mix_bus(&writer->resampled);
+    uninit_mix_bus(&writer->converted);
+  }
+  return !writer->stop;
+}
 
-      Action toggleAction;
-      toggleAction.type = ActionType::TOGGLE_NOTE;
-      toggleAction.data1 = (int) xd;
-      toggleAction.data2 = (int) yd;
-      undoStack.push(toggleAction);
-      clear_redo_stack();
+ma_uint32 export_frame_bytes()
+{
+  return exportChannels * ma_get_bytes_per_sample(exportFormat);
+}
 
-      gtk_widget_queue_draw(area);
+// one sample in exportFormat. This is done here and not with ma_pcm_convert, whose result can depend on how the
+// buffers are aligned, so every thread turns the same samples into the same bytes wherever they are written.
+// There is no dither for the same reason
+static inline void put_export_sample(ma_uint8* pOutput, float sample)
+{
+  sample = std::min(std::max(sample, -1.0f), 1.0f);
+  if (exportFormat == ma_format_s16)
+  {
+    ma_int16 value = (ma_int16) std::lrint(sample * 32767.0f);
+    memcpy(pOutput, &value, 2);
+  }
+  else
+  {
+    ma_int32 value = (ma_int32) std::lrint(sample * 8388607.0f);
+    pOutput[0] = (ma_uint8) value;
+    pOutput[1] = (ma_uint8) (value >> 8);
+    pOutput[2] = (ma_uint8) (value >> 16);
+  }
+}
+
+// interleaves stereo float frames into exportFormat, or mixes them down to mono if that is what gets exported.
+// Mono passed in as the same left and right comes out unchanged
+void convert_export_frames(void* pOutput, const float* pLeft, const float* pRight, ma_uint64 frameCount)
+{
+  if (exportFormat == ma_format_f32)
+  {
+    float* __restrict pFloats = (float*) pOutput;
+    int count = (int) frameCount;
+    if (exportChannels == 1)
+    {
+      for (int i = 0; i < count; i++)
+      {
+        pFloats[i] = (pLeft[i] + pRight[i]) * 0.5f;
+      }
+    }
+    else
+    {
+      for (int i = 0; i < count; i++)
+      {
+        pFloats[2 * i] = pLeft[i];
+        pFloats[2 * i + 1] = pRight[i];
+      }
+    }
+    return;
+  }
+
+  ma_uint8* pBytes = (ma_uint8*) pOutput;
+  ma_uint32 bytesPerSample = ma_get_bytes_per_sample(exportFormat);
+  for (ma_uint64 i = 0; i < frameCount; i++)
+  {
+    for (ma_uint32 c = 0; c < exportChannels; c++)
+    {
+      float sample = exportChannels == 1 ? (pLeft[i] + pRight[i]) * 0.5f : c == 0 ? pLeft[i] : pRight[i];
+      put_export_sample(pBytes, sample);
+      pBytes += bytesPerSample;
     }
   }
 }
 
-static void piano_roll_primary_drag_end (GtkGestureClick *gesture,
-         double           x,
-         double           y,
-         GtkWidget       *area)
+// what each export thread renders with. The voices run at exportOversampling times the render rate
+struct ExportRenderer
 {
-  // g_print("drag end\n");
-  editNoteSoundActive = false;
+  VoicePool* pool;
+  Oversampler oversamplers[2]; // one per channel
+  MixBus oversampled;   // one stereo block at the oversampled rate
+  MixBus scratch;       // one stereo segment at the render rate
+};
+
+void init_export_renderer(ExportRenderer* renderer, OscillatorType waveform, ma_uint32 renderSampleRate)
+{
+  // export has its own voices so it never races with the audio thread
+  renderer->pool = new VoicePool;
+  init_voice_pool(renderer->pool, waveform, renderSampleRate * exportOversampling);
+  for (int c = 0; c < 2; c++)
+  {
+    init_oversampler(&renderer->oversamplers[c], exportOversampling, EXPORT_BLOCK_FRAMES / exportOversampling);
+  }
+  init_mix_bus(&renderer->oversampled, EXPORT_BLOCK_FRAMES, 2);
+  init_mix_bus(&renderer->scratch, (ma_uint32) export_segment_frames(), 2);
 }
 
-static gboolean animate_piano_roll(GtkWidget* widget, GdkFrameClock* frame_clock, gpointer user_data)
+void uninit_export_renderer(ExportRenderer* renderer)
 {
-  // g_print("animation called\n");
-  if (!playing)
+  uninit_mix_bus(&renderer->scratch);
+  uninit_mix_bus(&renderer->oversampled);
+  for (int c = 0; c < 2; c++)
   {
-    return true;
+    uninit_oversampler(&renderer->oversamplers[c]);
   }
+  uninit_voice_pool(renderer->pool);
+  delete renderer->pool;
+}
 
-  if (previousFrameTime == -1)
+// renders frames [startFrame, startFrame + frameCount) at the oversampled rate a block at a time, on the same block
+// grid whatever the segment, and decimates them into the first frameCount / factor frames of scratch
+void render_oversampled_frames(ExportRenderer* renderer, ma_uint64 startFrame, ma_uint64 frameCount, const NoteStore* song)
+{
+  int factor = renderer->oversamplers[0].factor;
+  VoicePool* pool = renderer->pool;
+  preroll_voices(pool, song, startFrame);
+  for (ma_uint64 framesDone = 0; framesDone < frameCount; framesDone += EXPORT_BLOCK_FRAMES)
   {
-    previousFrameTime = gdk_frame_clock_get_frame_time(frame_clock);
-    return true; 
-  }  
+    ma_uint32 blockLength = (ma_uint32) std::min(frameCount - framesDone, (ma_uint64) EXPORT_BLOCK_FRAMES);
+    render_song_frames(mix_bus_channel(&renderer->oversampled, 0), mix_bus_channel(&renderer->oversampled, 1),
+                       startFrame + framesDone, blockLength, pool->sampleRate, song, pool);
+    for (int c = 0; c < 2; c++)
+    {
+      downsample(&renderer->oversamplers[c], mix_bus_channel(&renderer->oversampled, c), blockLength / factor,
+                 mix_bus_channel(&renderer->scratch, c) + framesDone / factor);
+    }
+  }
+}
 
-  // g_print("animating...\n");
-  // may want to use gdk_frame_clock_get_predicted_presentation_time in the future instead
+// renders a segment into pOutput in the export format. If it still has to be resampled, pOutput gets float
+// instead, exportChannels channels of export_segment_frames() one after the other
+void render_export_segment(ExportRenderer* renderer, void* pOutput, ma_uint64 startFrame, ma_uint64 frameCount,
+                           const NoteStore* song, bool convert = true)
+{
+  float* pLeft = mix_bus_channel(&renderer->scratch, 0);
+  float* pRight = mix_bus_channel(&renderer->scratch, 1);
+  int factor = renderer->oversamplers[0].factor;
+  if (factor == 1)
+  {
+    render_song_segment(pLeft, pRight, startFrame, frameCount, song, renderer->pool);
+  }
+  else
+  {
+    ma_uint64 oversampledStart = startFrame * factor;
+    if (renderer->pool->frame != oversampledStart)
+    {
+      // another thread rendered the segment before this one. The decimators only remember a few dozen inputs, so
+      // running the block before the segment through them leaves them just as they would be after the whole song
+      // up to here, and the samples come out exactly the same as a serial export
+      for (int c = 0; c < 2; c++)
+      {
+        reset_oversampler(&renderer->oversamplers[c]);
+      }
+      render_oversampled_frames(renderer, oversampledStart - EXPORT_BLOCK_FRAMES, EXPORT_BLOCK_FRAMES, song);
+    }
+    render_oversampled_frames(renderer, oversampledStart, frameCount * factor, song);
+  }
 
-  int frameTime = gdk_frame_clock_get_frame_time(frame_clock);
-  float deltaT = microseconds_to_seconds(frameTime - previousFrameTime);
+  if (convert)
+  {
+    convert_export_frames(pOutput, pLeft, pRight, frameCount);
+  }
+  else if (exportChannels == 1)
+  {
+    float* pMono = (float*) pOutput;
+    for (ma_uint64 i = 0; i < frameCount; i++)
+    {
+      pMono[i] = (pLeft[i] + pRight[i]) * 0.5f;
+    }
+  }
+  else
+  {
+    memcpy(pOutput, pLeft, frameCount * sizeof(float));
+    memcpy((float*) pOutput + export_segment_frames(), pRight, frameCount * sizeof(float));
+  }
+}
 
-  playbackTime += deltaT;
-  // g_printf("playback time: %f\n", playbackTime);
-  if (playbackTime >= (double) pianoGridWidth / tempo)
+// renders segments until there are none left. Each thread keeps its voices between segments, so it only has to
+// preroll over the segments the other threads rendered in the meantime
+void render_export_segments(ExportWriter* writer, const NoteStore* song, OscillatorType waveform)
+{
+  ExportRenderer renderer;
+  init_export_renderer(&renderer, waveform, writer->renderSampleRate);
+  ma_uint64 totalFrames = song_length_in_frames(writer->renderSampleRate);
+  int buffer;
+  int segment;
+  while (acquire_export_buffer(writer, &buffer, &segment))
   {
-    // finish playing (will need to adjust conditions later)
-    reset_playback(NULL, widget);
-    return true;
+    ma_uint64 startFrame = segment * export_segment_frames();
+    ma_uint64 frameCount = std::min(export_segment_frames(), totalFrames - startFrame);
+    render_export_segment(&renderer, writer->buffers[buffer].samples, startFrame, frameCount, song,
+                          writer->resampler == NULL);
+    submit_export_buffer(writer, buffer, (ma_uint32) frameCount);
   }
-  
-  // update audio
-  
-  playbackX = (int) (playbackTime * tempo);
+  uninit_export_renderer(&renderer);
+}
 
-  // update scrubber
+// reports how an export went once the encoder is closed. A cancelled export leaves no file behind
+bool finish_export(const char* path, bool ok, ma_uint64 totalWrittenFrames, ExportProgress* progress)
+{
+  if (progress != NULL && progress->cancelled.load(std::memory_order_relaxed))
+  {
+    g_print("Export cancelled.\n");
+    remove(path);
+    return false;
+  }
+  if (ok)
+  {
+    g_printf("Finished export. Total frames written: %llu\n", (unsigned long long) totalWrittenFrames);
+  }
+  return ok;
+}
 
-  int width = gtk_widget_get_allocated_width(widget);
-  scrubberPosition = playbackTime * tempo * ((double) width - 2 * pianoRollBorder) / pianoGridWidth;
-  previousFrameTime = frameTime;
+#ifdef SILLY_SYNTH_MMAP
 
-  // g_print("queueing redraw\n");
-  gtk_widget_queue_draw(widget);
-    
+// a wav file mapped into memory, so export threads can render straight into it with no copies or write calls
+struct MappedWav
+{
+  int file;
+  unsigned char* bytes;
+  size_t size;
+  ma_uint64 frameCount;
+};
 
-  return true; // I guess?
+// makes the file exactly as big as the finished wav and maps it. False if the file can't be set up this way
+bool map_wav_file(MappedWav* wav, const char* path, ma_uint64 frameCount)
+{
+  ma_uint64 dataBytes = frameCount * export_frame_bytes();
+  // the riff sizes are 32 bits
+  if (dataBytes + WAV_HEADER_BYTES - 8 > 0xFFFFFFFF)
+  {
+    return false;
+  }
+  wav->frameCount = frameCount;
+  wav->size = (size_t) (WAV_HEADER_BYTES + dataBytes);
+  wav->file = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+  if (wav->file == -1)
+  {
+    return false;
+  }
+  bool ok = ftruncate(wav->file, (off_t) wav->size) == 0;
+#ifdef __linux__
+  // actually reserve the disk space, so a full disk is an error here and not a SIGBUS while rendering
+  ok = ok && posix_fallocate(wav->file, 0, (off_t) wav->size) == 0;
+#endif
+  wav->bytes = (unsigned char*) MAP_FAILED;
+  if (ok)
+  {
+    wav->bytes = (unsigned char*) mmap(NULL, wav->size, PROT_READ | PROT_WRITE, MAP_SHARED, wav->file, 0);
+  }
+  if (wav->bytes == MAP_FAILED)
+  {
+    close(wav->file);
+    remove(path);
+    return false;
+  }
+  return true;
 }
 
-static void draw_piano_roll(GtkDrawingArea *area,
-               cairo_t        *cr,
-               int             width,
-               int             height,
-               gpointer        data)
+void put_le(unsigned char* bytes, ma_uint32 value, int byteCount)
+{
+  for (int i = 0; i < byteCount; i++)
+  {
+    bytes[i] = (unsigned char) (value >> (8 * i));
+  }
+}
+
+// the same 44 byte header ma_encoder writes, filled in once the data is all there
+void write_wav_header(MappedWav* wav)
+{
+  ma_uint32 bytesPerSample = ma_get_bytes_per_sample(exportFormat);
+  ma_uint32 dataBytes = (ma_uint32) (wav->size - WAV_HEADER_BYTES);
+  unsigned char* h = wav->bytes;
+  memcpy(h, "RIFF", 4);
+  put_le(h + 4, dataBytes + WAV_HEADER_BYTES - 8, 4);
+  memcpy(h + 8, "WAVEfmt ", 8);
+  put_le(h + 16, 16, 4);
+  put_le(h + 20, exportFormat == ma_format_f32 ? 3 : 1, 2); // ieee float or pcm
+  put_le(h + 22, exportChannels, 2);
+  put_le(h + 24, exportSampleRate, 4);
+  put_le(h + 28, exportSampleRate * exportChannels * bytesPerSample, 4);
+  put_le(h + 32, exportChannels * bytesPerSample, 2);
+  put_le(h + 34, bytesPerSample * 8, 2);
+  memcpy(h + 36, "data", 4);
+  put_le(h + 40, dataBytes, 4);
+}
+
+bool unmap_wav_file(MappedWav* wav)
 {
+  bool ok = munmap(wav->bytes, wav->size) == 0;
+  return close(wav->file) == 0 && ok;
+}
 
-  // https://cairographics.org/manual/cairo-cairo-t.html
+// renders segments straight into the mapping until there are none left
+void render_mapped_segments(MappedWav* wav, std::atomic<int>* nextSegment, const NoteStore* song, OscillatorType waveform,
+                            ExportProgress* progress)
+{
+  unsigned char* frames = wav->bytes + WAV_HEADER_BYTES;
+  int segmentCount = (int) ((wav->frameCount + export_segment_frames() - 1) / export_segment_frames());
+  ExportRenderer renderer;
+  init_export_renderer(&renderer, waveform, exportSampleRate);
+  while (progress == NULL || !progress->cancelled.load(std::memory_order_relaxed))
+  {
+    int segment = nextSegment->fetch_add(1, std::memory_order_relaxed);
+    if (segment >= segmentCount)
+    {
+      break;
+    }
+    ma_uint64 startFrame = segment * export_segment_frames();
+    ma_uint64 frameCount = std::min(export_segment_frames(), wav->frameCount - startFrame);
+    render_export_segment(&renderer, frames + startFrame * export_frame_bytes(), startFrame, frameCount, song);
+    if (progress != NULL)
+    {
+      progress->framesDone.fetch_add(frameCount, std::memory_order_relaxed);
+    }
+  }
+  uninit_export_renderer(&renderer);
+}
 
-  GdkRGBA whiteKeyColor, blackKeyColor, gridLineColor, noteColor, scrubberColor;
+// renders on threadCount threads into a wav file mapped into memory. Every segment lands in its own part of the file,
+// so there are no buffers to hand around and no write calls, and the header goes in last
+bool render_song_to_mapped_file(MappedWav* wav, const NoteStore* song, OscillatorType waveform, int threadCount,
+                                ExportProgress* progress)
+{
+  std::atomic<int> nextSegment(0);
+  vector<std::thread> threads;
+  for (int t = 1; t < threadCount; t++)
+  {
+    threads.emplace_back(render_mapped_segments, wav, &nextSegment, song, waveform, progress);
+  }
+  render_mapped_segments(wav, &nextSegment, song, waveform, progress);
+  for (std::thread& thread : threads)
+  {
+    thread.join();
+  }
+  write_wav_header(wav);
+  return unmap_wav_file(wav);
+}
 
-  whiteKeyColor.red = 0.8;
-  whiteKeyColor.green = 0.8;
-  whiteKeyColor.blue = 0.8;
-  whiteKeyColor.alpha = 1.0;
+#endif
 
-  blackKeyColor.red = 0.5;
-  blackKeyColor.green = 0.5;
-  blackKeyColor.blue = 0.5;
-  blackKeyColor.alpha = 1.0;
+enum ExportBackend
+{
+  ENCODER_EXPORT_BACKEND, // ma_encoder fed by a writer thread
+  MMAP_EXPORT_BACKEND     // threads render straight into the mapped file, falls back to the encoder where that can't work
+};
 
-  gridLineColor.red = 0.0;
-  gridLineColor.green = 0.0;
-  gridLineColor.blue = 0.0;
-  gridLineColor.alpha = 1.0;
-  
-  noteColor.red = 0.0;
-  noteColor.green = 0.0;
-  noteColor.blue = 0.0;
-  noteColor.alpha = 1.0;
+ExportBackend exportBackend = MMAP_EXPORT_BACKEND;
 
-  scrubberColor.red = 1.0;
-  scrubberColor.green = 0.0;
-  scrubberColor.blue = 0.0;
-  scrubberColor.alpha = 1.0;
+// renders the whole song to a wav file with the offline path. The calling thread waits until it is done.
+// If progress is given it is kept up to date, and setting its cancelled flag stops the export and removes the file
+bool render_song_to_file(const char* path, const NoteStore* song, OscillatorType waveform, ExportProgress* progress = NULL)
+{
+  int threadCount = exportThreadCount;
+  if (threadCount <= 0)
+  {
+    threadCount = std::max((int) std::thread::hardware_concurrency(), 1);
+  }
 
-  // draw key colors
-  bool keyColors[] = {1, 0, 1, 0, 1, 1, 0, 1, 0, 1, 0, 1};
-  double keyHeight = (double) (height - 2 * pianoRollBorder) / pianoKeyCount;
-  double keyWidth = (double) (width - 2 * pianoRollBorder) / pianoGridWidth;
+  ma_uint64 totalFramesToWrite = song_length_in_frames(exportSampleRate);
+  if (progress != NULL)
+  {
+    progress->totalFrames.store(totalFramesToWrite, std::memory_order_relaxed);
+  }
 
-  for (int k = 0; k < pianoKeyCount; k++)
+  ma_uint32 renderSampleRate = exportRenderSampleRate != 0 ? exportRenderSampleRate : exportSampleRate;
+  if (exportOversampling > 1)
   {
-    if (keyColors[k % 12])
+    g_print("Oversampling %ix (%u Hz)\n", exportOversampling, renderSampleRate * exportOversampling);
+  }
+
+#ifdef SILLY_SYNTH_MMAP
+  // resampling runs through the song in order, so it goes through the writer thread and not the mapping
+  MappedWav wav;
+  if (exportBackend == MMAP_EXPORT_BACKEND && renderSampleRate == exportSampleRate && map_wav_file(&wav, path, totalFramesToWrite))
+  {
+    g_print("Beginning export to %s (mapped) on %i thread(s)...\n", path, threadCount);
+    bool ok = render_song_to_mapped_file(&wav, song, waveform, threadCount, progress);
+    if (!ok)
     {
-      gdk_cairo_set_source_rgba(cr, &whiteKeyColor);
-    } 
-    else
+      g_print("encountered an error while exporting\n");
+    }
+    return finish_export(path, ok, totalFramesToWrite, progress);
+  }
+#endif
+
+  ma_encoder_config config = ma_encoder_config_init(ma_encoding_format_wav, exportFormat, exportChannels, exportSampleRate);
+  ma_encoder encoder;
+  ma_result result = ma_encoder_init_file(path, &config, &encoder);
+  if (result != MA_SUCCESS) {
+    // Error
+    g_print("encountered an error while initializing file\n");
+    return false;
+  }
+  
+  g_print("Beginning export to %s on %i thread(s)...\n", path, threadCount);
+  if (renderSampleRate != exportSampleRate)
+  {
+    g_print("Rendering at %u Hz and resampling (%s quality)\n", renderSampleRate, resamplerQualityNames[resamplerQuality]);
+  }
+
+  // two buffers per rendering thread, so every thread can render the next segment while its last one is written
+  ExportWriter* writer = new ExportWriter;
+  start_export_writer(writer, &encoder, progress, renderSampleRate, threadCount * 2);
+  vector<std::thread> threads;
+  for (int t = 1; t < std::min(threadCount, writer->segmentCount); t++)
+  {
+    threads.emplace_back(render_export_segments, writer, song, waveform);
+  }
+  render_export_segments(writer, song, waveform);
+  for (std::thread& thread : threads)
+  {
+    thread.join();
+  }
+  bool ok = finish_export_writer(writer);
+  ma_uint64 totalWrittenFrames = writer->framesWritten;
+  delete writer;
+
+  ma_encoder_uninit(&encoder);
+  return finish_export(path, ok, totalWrittenFrames, progress);
+}
+
+// an export running on its own thread, so it never holds up the gtk main loop or the audio device.
+// It renders its own copy of the notes, so the roll can be edited while it runs
+struct ExportJob
+{
+  NoteStore song;
+  OscillatorType waveform;
+  ExportProgress progress;
+  std::chrono::steady_clock::time_point startTime;
+  bool ok;
+  std::thread thread;
+  guint progressTimer; // the timeout updating the status label, removed with the job
+};
+
+ExportJob* exportJob = NULL; // the running export, only touched by the gtk thread
+GtkWidget* exportButton = NULL;
+GtkWidget* exportStatus = NULL;
+GtkWidget* exportSettings = NULL; // the export rate, channel and format drop downs, locked while an export runs
+
+static void update_export_rate(GObject* dropDown, GParamSpec* pspec, gpointer data)
+{
+  exportSampleRate = supportedSampleRates[gtk_drop_down_get_selected(GTK_DROP_DOWN(dropDown))];
+}
+
+static void update_export_channels(GObject* dropDown, GParamSpec* pspec, gpointer data)
+{
+  exportChannels = gtk_drop_down_get_selected(GTK_DROP_DOWN(dropDown)) + 1;
+}
+
+static void update_export_format(GObject* dropDown, GParamSpec* pspec, gpointer data)
+{
+  exportFormat = supportedExportFormats[gtk_drop_down_get_selected(GTK_DROP_DOWN(dropDown))];
+}
+
+static gboolean finish_export_job(gpointer data)
+{
+  ExportJob* job = (ExportJob*) data;
+  job->thread.join();
+  if (job->progress.cancelled.load())
+  {
+    gtk_label_set_text(GTK_LABEL(exportStatus), "Export cancelled");
+  }
+  else
+  {
+    gtk_label_set_text(GTK_LABEL(exportStatus), job->ok ? "Exported my_file.wav" : "Export failed");
+  }
+  gtk_button_set_label(GTK_BUTTON(exportButton), "Export");
+  gtk_widget_set_sensitive(exportSettings, TRUE);
+  g_source_remove(job->progressTimer);
+  exportJob = NULL;
+  delete job;
+  return G_SOURCE_REMOVE;
+}
+
+void export_thread(ExportJob* job)
+{
+  job->ok = render_song_to_file("my_file.wav", &job->song, job->waveform, &job->progress);
+  // the gtk thread cleans up, so everything the ui touches stays on one thread
+  g_idle_add(finish_export_job, job);
+}
+
+static gboolean update_export_progress(gpointer data)
+{
+  ma_uint64 framesDone = exportJob->progress.framesDone.load(std::memory_order_relaxed);
+  ma_uint64 totalFrames = exportJob->progress.totalFrames.load(std::memory_order_relaxed);
+  double elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - exportJob->startTime).count();
+  char text[64];
+  if (framesDone == 0 || totalFrames == 0)
+  {
+    g_snprintf(text, sizeof(text), "Exporting...");
+  }
+  else
+  {
+    double remaining = elapsed * (totalFrames - framesDone) / framesDone;
+    g_snprintf(text, sizeof(text), "Exporting %i%%, %.0f s left", (int) (100 * framesDone / totalFrames), remaining);
+  }
+  gtk_label_set_text(GTK_LABEL(exportStatus), text);
+  return G_SOURCE_CONTINUE;
+}
+
+// starts an export, or cancels the one that is running
+static void export_song(GtkWidget* widget, gpointer data)
+{
+  if (exportJob != NULL)
+  {
+    exportJob->progress.cancelled.store(true);
+    gtk_label_set_text(GTK_LABEL(exportStatus), "Cancelling export...");
+    return;
+  }
+
+  exportJob = new ExportJob;
+  exportJob->song = notes;
+  exportJob->waveform = oscillator_type_from_selection(selectedWaveform);
+  exportJob->progress.framesDone.store(0);
+  exportJob->progress.totalFrames.store(0);
+  exportJob->progress.cancelled.store(false);
+  exportJob->startTime = std::chrono::steady_clock::now();
+  exportJob->ok = false;
+  exportJob->thread = std::thread(export_thread, exportJob);
+
+  gtk_button_set_label(GTK_BUTTON(exportButton), "Cancel export");
+  // the export threads read the settings while they run
+  gtk_widget_set_sensitive(exportSettings, FALSE);
+  gtk_label_set_text(GTK_LABEL(exportStatus), "Exporting...");
+  exportJob->progressTimer = g_timeout_add(EXPORT_PROGRESS_INTERVAL, update_export_progress, NULL);
+}
+
+// stops a running export before the app goes away. The job is freed here, so the finish_export_job the export
+// thread may have queued on its way out is taken off the main loop with it
+void cancel_export_job()
+{
+  if (exportJob != NULL)
+  {
+    exportJob->progress.cancelled.store(true);
+    exportJob->thread.join();
+    g_idle_remove_by_data(exportJob);
+    g_source_remove(exportJob->progressTimer);
+    delete exportJob;
+    exportJob = NULL;
+  }
+}
+
+static void save_song_button(GtkWidget* widget, gpointer data)
+{
+  if (save_song("my_song.ssy", &notes, oscillator_type_from_selection(selectedWaveform)))
+  {
+    g_print("Saved song to my_song.ssy\n");
+  }
+}
+
+// silly_synth --render song.ssy -o out.wav [-j threads] [--no-mmap] renders the song without a window or an audio device
+int render_headless(const char* songPath, const char* outputPath)
+{
+  init_oscillator_kernels();
+
+  OscillatorType waveform = SINE_OSCILLATOR;
+  if (!load_song(songPath, &notes, &waveform))
+  {
+    return 1;
+  }
+  return render_song_to_file(outputPath, &notes, waveform) ? 0 : 1;
+}
+
+// a roll of random notes on about half of the cells of every key, the same every run
+void fill_bench_notes(NoteStore* store)
+{
+  vector<NoteEvent> events;
+  srand(1);
+  for (int key = 0; key < pianoKeyCount; key++)
+  {
+    int column = rand() % 8;
+    while (column < pianoGridWidth)
     {
-      gdk_cairo_set_source_rgba(cr, &blackKeyColor);
-      
+      int length = std::min(1 + rand() % 8, pianoGridWidth - column);
+      events.push_back({column, length, key, 1.0f, 0.0f, 0});
+      column += length + 1 + rand() % 8;
     }
-    cairo_rectangle (cr, pianoRollBorder, height - (k + 1) * keyHeight - pianoRollBorder, width - (2 * pianoRollBorder), keyHeight);
-    cairo_fill (cr);
   }
+  std::sort(events.begin(), events.end(), note_before);
+  set_store_notes(store, events);
+}
+
+void damage_bench_nothing()
+{
+}
+
+// a cell in the middle of the view
+void damage_bench_cell()
+{
+  RollView view = piano_roll_view(DRAW_BENCH_WIDTH, DRAW_BENCH_HEIGHT);
+  int column = (int) view_column(view, DRAW_BENCH_WIDTH / 2);
+  int key = (int) view_key(view, DRAW_BENCH_HEIGHT / 2);
+  damage_piano_roll_cells(column, column, key, key);
+}
+
+// scrolling quickly, a thousand pixels a second at 60 frames a second
+void damage_bench_scroll()
+{
+  viewColumn += 16 / columnWidth;
+}
+
+// the average ms a frame of the roll takes at scale when damage is done before each frame. It goes through
+// draw_piano_roll_frame like the widget does, so the tiles are made and blitted the same way
+double time_piano_roll_frames(cairo_t* cr, int scale, void (*damage)())
+{
+  std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+  for (int i = 0; i < DRAW_BENCH_FRAMES; i++)
+  {
+    damage();
+    draw_piano_roll_frame(cr, DRAW_BENCH_WIDTH, DRAW_BENCH_HEIGHT, scale);
+    cairo_surface_flush(cairo_get_target(cr));
+  }
+  return std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count() / DRAW_BENCH_FRAMES;
+}
 
-  // draw notes
-  
-  gdk_cairo_set_source_rgba(cr, &noteColor);
-  for (int i = 0; i < pianoGridWidth; i++)
+// silly_synth --bench-draw draws 88 key rolls of 1000, 10000 and 100000 columns into an offscreen surface, at the
+// starting zoom and zoomed all the way out and at scale factors 1 and 2, and prints how long each kind of frame takes
+int bench_draw()
+{
+  const int gridWidths[] = {1000, 10000, 100000};
+  const double columnWidths[] = {PIANO_ROLL_COLUMN_WIDTH, PIANO_ROLL_MIN_COLUMN_WIDTH};
+  pianoKeyCount = 88;
+  for (int scale = 1; scale <= DRAW_BENCH_MAX_SCALE; scale++)
   {
-    for (int j = 0; j < pianoKeyCount; j++)
+    cairo_surface_t* surface = create_piano_roll_surface(DRAW_BENCH_WIDTH, DRAW_BENCH_HEIGHT, scale);
+    cairo_t* cr = cairo_create(surface);
+    for (int gridWidth : gridWidths)
     {
-      if (get_note(i,j))
+      pianoGridWidth = gridWidth;
+      fill_bench_notes(&notes);
+      for (double width : columnWidths)
       {
-        cairo_rectangle(cr, 
-                        pianoRollBorder + i * (width - 2 * pianoRollBorder) / pianoGridWidth,
-                        height - pianoRollBorder - (j + 1) * keyHeight,
-                        (width - 2 * pianoRollBorder) / pianoGridWidth,
-                        keyHeight);
-        cairo_fill(cr);
+        columnWidth = width;
+        viewColumn = 0.0;
+        g_print("%ix%i grid, %i notes, %ix%i pixels at scale %i, %g pixels a column\n", pianoGridWidth, pianoKeyCount,
+                notes.noteCount, DRAW_BENCH_WIDTH, DRAW_BENCH_HEIGHT, scale, columnWidth);
+        g_print("  every tile drawn again: %8.3f ms\n", time_piano_roll_frames(cr, scale, damage_piano_roll));
+        g_print("  scrolling:              %8.3f ms\n", time_piano_roll_frames(cr, scale, damage_bench_scroll));
+        g_print("  one note toggled:       %8.3f ms\n", time_piano_roll_frames(cr, scale, damage_bench_cell));
+        g_print("  scrubber moved:         %8.3f ms\n", time_piano_roll_frames(cr, scale, damage_bench_nothing));
       }
     }
+    cairo_destroy(cr);
+    cairo_surface_destroy(surface);
   }
-  
-
-  // draw grid lilnes
-
-  double gridLineWidth = 2.0;
-  cairo_set_line_width(cr, gridLineWidth);  
-  gdk_cairo_set_source_rgba(cr, &gridLineColor);
-
-  // horizontal
-  for (int k = 1; k < pianoKeyCount; k++)
-  {
-    cairo_move_to(cr, pianoRollBorder, height - k * keyHeight - pianoRollBorder);
-    cairo_line_to(cr, width - pianoRollBorder, height - k * keyHeight - pianoRollBorder);
-    cairo_stroke(cr);
-  }
+  damage_piano_roll();
+  return 0;
+}
 
-  // vertical
-  for (int j = 1; j < pianoGridWidth; j++)
+// the phase increments and starting phases of the synth benchmark's voices, spread over the keyboard
+void init_bench_voices(double* increments, double* phases, ma_uint32 sampleRate)
+{
+  for (int v = 0; v < SYNTH_BENCH_VOICES; v++)
   {
-    cairo_move_to(cr, j * (width - 2 * pianoRollBorder) / pianoGridWidth + pianoRollBorder, pianoRollBorder);
-    cairo_line_to(cr, j * (width - 2 * pianoRollBorder) / pianoGridWidth + pianoRollBorder, height - pianoRollBorder);
-    cairo_stroke(cr);
+    increments[v] = pitch_from_note(24 + 5 * v) / sampleRate;
+    phases[v] = v * 0.37 - std::floor(v * 0.37);
   }
-
-  // draw playback scrubber
-  cairo_set_line_width(cr, scrubberWidth);
-  gdk_cairo_set_source_rgba(cr, &scrubberColor);
-  cairo_move_to(cr, pianoRollBorder + scrubberPosition, pianoRollBorder - scrubberHeightOffset);
-  cairo_line_to(cr, pianoRollBorder + scrubberPosition, height - pianoRollBorder + scrubberHeightOffset);
-  cairo_stroke(cr);
 }
 
-// currently, we simply have a wave for every single possible note :P
-ma_waveform** waves;
-int selectedWaveform = 0;
-
-static void update_instrument_select(GtkWidget* widget, gpointer data)
+// ns per voice and frame for kernel mixing the benchmark voices into one block after another
+double time_oscillator_kernel(OscillatorKernel kernel, float* block)
 {
-  int selected = gtk_drop_down_get_selected(GTK_DROP_DOWN(widget));
-  if (selected != selectedWaveform)
+  double increments[SYNTH_BENCH_VOICES];
+  double phases[SYNTH_BENCH_VOICES];
+  init_bench_voices(increments, phases, 48000);
+  auto start = std::chrono::steady_clock::now();
+  for (int frame = 0; frame < SYNTH_BENCH_FRAMES; frame += MIXER_BLOCK_FRAMES)
   {
-    g_print("instrument updating...\n");
-    selectedWaveform = selected;
-    ma_waveform_type type;
-    switch(selectedWaveform)
-    {
-      case(0):
-        type = ma_waveform_type_sine;
-        break;
-      case(1):
-        type = ma_waveform_type_square;
-        break;
-      case(2):
-        type = ma_waveform_type_triangle;
-        break;
-      case(3):
-        type = ma_waveform_type_sawtooth;
-        break;
-    }
-
-    for (int i = 0; i < pianoKeyCount; i++)
+    memset(block, 0, MIXER_BLOCK_FRAMES * sizeof(float));
+    for (int v = 0; v < SYNTH_BENCH_VOICES; v++)
     {
-      ma_waveform_set_type(waves[i], type);
+      kernel(block, MIXER_BLOCK_FRAMES, &phases[v], increments[v], VOICE_AMPLITUDE, 0.0f);
     }
   }
+  double ns = std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count();
+  return ns / ((double) SYNTH_BENCH_FRAMES * SYNTH_BENCH_VOICES);
 }
 
-void data_callback(ma_device* pDevice, void* pOutput, const void* pInput, ma_uint32 frameCount)
+// the same for the way voices were rendered before the kernels: ma_waveform reads each one into a buffer, which
+// is then added to the block
+double time_ma_waveform(ma_waveform_type type, float* block, float* voiceBlock)
 {
-	if (playing || exporting)
-	{
-	  // In playback mode copy data to pOutput. In capture mode read data from pInput. In full-duplex mode, both
-    // pOutput and pInput will be valid and you can move data from pInput into pOutput. Never process more than
-    // frameCount frames.
-  
-    // MA_ASSERT(pDevice->playback.channels == DEVICE_CHANNELS);
-
-    // MA_ASSERT(pSineWave != NULL);
-   
-    // g_print("playing or exporting\n"); 
-    // g_printf("playbackX = %i\n", playbackX);
- 
-    float* pOutputF32 = (float*)pOutput;
-    for (int i = 0; i < frameCount; i++)
+  double increments[SYNTH_BENCH_VOICES];
+  double phases[SYNTH_BENCH_VOICES];
+  init_bench_voices(increments, phases, 48000);
+  ma_waveform waves[SYNTH_BENCH_VOICES];
+  for (int v = 0; v < SYNTH_BENCH_VOICES; v++)
+  {
+    ma_waveform_config config = ma_waveform_config_init(ma_format_f32, 1, 48000, type, VOICE_AMPLITUDE,
+                                                        increments[v] * 48000);
+    ma_waveform_init(&config, &waves[v]);
+  }
+  auto start = std::chrono::steady_clock::now();
+  for (int frame = 0; frame < SYNTH_BENCH_FRAMES; frame += MIXER_BLOCK_FRAMES)
+  {
+    memset(block, 0, MIXER_BLOCK_FRAMES * sizeof(float));
+    for (int v = 0; v < SYNTH_BENCH_VOICES; v++)
     {
-          pOutputF32[i] = 0.0f;
+      ma_waveform_read_pcm_frames(&waves[v], voiceBlock, MIXER_BLOCK_FRAMES, NULL);
+      for (int i = 0; i < MIXER_BLOCK_FRAMES; i++)
+      {
+        block[i] += voiceBlock[i];
+      }
     }
+  }
+  double ns = std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count();
+  for (int v = 0; v < SYNTH_BENCH_VOICES; v++)
+  {
+    ma_waveform_uninit(&waves[v]);
+  }
+  return ns / ((double) SYNTH_BENCH_FRAMES * SYNTH_BENCH_VOICES);
+}
 
-    for (int k = 0; k < pianoKeyCount; k++)
+// the largest difference between what kernel and reference render for the benchmark voices, over calls of different
+// lengths (so the vector tails get checked too) and with a gain ramp. The kernels keep their phase in float and round
+// it differently, so on the steep parts of a PolyBLEP or wavetable wave they can be a few thousandths apart, and
+// right at the jump of a square or saw one of them can land a sample on the other side, so those are left out.
+// A wrong lane, phase step or gain ramp is off by far more
+float compare_oscillator_kernels(OscillatorKernel kernel, OscillatorKernel reference, float* block, float* referenceBlock)
+{
+  double increments[SYNTH_BENCH_VOICES];
+  double phases[SYNTH_BENCH_VOICES];
+  init_bench_voices(increments, phases, 48000);
+  float largest = 0.0f;
+  for (int v = 0; v < SYNTH_BENCH_VOICES; v++)
+  {
+    double phase = phases[v];
+    double referencePhase = phases[v];
+    for (int call = 0; call < SYNTH_BENCH_CALLS; call++)
     {
-      if (get_note(playbackX, k))
+      ma_uint32 frames = MIXER_BLOCK_FRAMES - call * 509;
+      double startPhase = phase;
+      memset(block, 0, frames * sizeof(float));
+      memset(referenceBlock, 0, frames * sizeof(float));
+      kernel(block, frames, &phase, increments[v], 0.5f, -0.5f / frames);
+      reference(referenceBlock, frames, &referencePhase, increments[v], 0.5f, -0.5f / frames);
+      for (ma_uint32 i = 0; i < frames; i++)
       {
-        // read into temporary buffer and then add to output buffer
-        float temp[frameCount];
-        for (int i = 0; i < frameCount; i++)
-        {
-          temp[i] = 0.0f;
-        }      
-        ma_waveform_read_pcm_frames(waves[k], temp, frameCount, NULL);
-        // g_print("waveform read pcm frames\n");
-        for (int i = 0; i < frameCount; i++)
+        double p = startPhase + i * increments[v];
+        p -= std::floor(p);
+        if (std::fabs(2.0 * p - std::round(2.0 * p)) < SYNTH_BENCH_JUMP_WINDOW)
         {
-          pOutputF32[i] += temp[i];
+          continue;
         }
+        largest = std::max(largest, std::fabs(block[i] - referenceBlock[i]));
       }
     }
- 
-		(void)pInput;   /* Unused. */    
-	}
-  else if (editNoteSoundActive)
-  {
-
-    // MA_ASSERT(pDevice->playback.channels == DEVICE_CHANNELS);
-	
-    // MA_ASSERT(pSineWave != NULL);
-
-    ma_waveform_read_pcm_frames(waves[editY], pOutput, frameCount, NULL);
   }
+  return largest;
 }
 
-
-
-static void export_song(GtkWidget* widget, gpointer data)
+// how loud everything that isn't a harmonic of ALIAS_BENCH_FREQUENCY is next to the harmonics, in dB, for one note
+// of type played at 48000 Hz. Everything under nyquist that isn't a harmonic folded back from above it
+double measure_alias_energy(OscillatorType type)
 {
-  
-  ma_encoder_config config = ma_encoder_config_init(ma_encoding_format_wav, EXPORT_FORMAT, EXPORT_CHANNELS, EXPORT_SAMPLE_RATE);
-  ma_encoder encoder;
-  ma_result result = ma_encoder_init_file("my_file.wav", &config, &encoder);
-  if (result != MA_SUCCESS) {
-    // Error
-    g_print("encountered an error while initializing file\n");
-    return;
+  const ma_uint32 sampleRate = 48000;
+  vector<float> samples(ALIAS_BENCH_FRAMES, 0.0f);
+  double phase = 0.0;
+  for (int frame = 0; frame < ALIAS_BENCH_FRAMES; frame += MIXER_BLOCK_FRAMES)
+  {
+    ma_uint32 frames = std::min(ALIAS_BENCH_FRAMES - frame, MIXER_BLOCK_FRAMES);
+    oscillatorKernels[type](samples.data() + frame, frames, &phase, ALIAS_BENCH_FREQUENCY / sampleRate, 1.0f, 0.0f);
   }
-  
-  ma_uint64 bufferLength = 1; // IDK if 64 is good here. Can it be a smaller number?
 
-  // iterate through the whole song with the sample rate
-  
-  double playbackTimeSave = playbackTime;
-  int playbackXSave = playbackX;
-  playbackTime = 0.0;
-  playbackX = 0;
-  exporting = true;
+  vector<double> windowed(ALIAS_BENCH_FRAMES);
+  vector<double> cosines(ALIAS_BENCH_FRAMES);
+  vector<double> sines(ALIAS_BENCH_FRAMES);
+  for (int n = 0; n < ALIAS_BENCH_FRAMES; n++)
+  {
+    double w = 2.0 * n / (ALIAS_BENCH_FRAMES - 1) - 1.0;
+    windowed[n] = samples[n] * bessel_i0(ALIAS_BENCH_BETA * std::sqrt(std::max(1.0 - w * w, 0.0)));
+    cosines[n] = std::cos(2.0 * M_PI * n / ALIAS_BENCH_FRAMES);
+    sines[n] = std::sin(2.0 * M_PI * n / ALIAS_BENCH_FRAMES);
+  }
 
-  int totalWrittenFrames = 0;
-  int totalFramesToWrite = (double)pianoGridWidth / tempo * EXPORT_SAMPLE_RATE;
-  
-  g_print("Beginning export to file...\n");
+  // a plain dft, only a few of them are ever done
+  double harmonicEnergy = 0.0;
+  double aliasEnergy = 0.0;
+  double binWidth = (double) sampleRate / ALIAS_BENCH_FRAMES;
+  for (int bin = 1; bin < ALIAS_BENCH_FRAMES / 2; bin++)
+  {
+    double re = 0.0;
+    double im = 0.0;
+    for (int n = 0; n < ALIAS_BENCH_FRAMES; n++)
+    {
+      int k = (int) (((long) bin * n) % ALIAS_BENCH_FRAMES);
+      re += windowed[n] * cosines[k];
+      im -= windowed[n] * sines[k];
+    }
+    double frequency = bin * binWidth;
+    double harmonic = std::round(frequency / ALIAS_BENCH_FREQUENCY);
+    bool isHarmonic = harmonic >= 1.0 && harmonic * ALIAS_BENCH_FREQUENCY < sampleRate / 2.0
+                      && std::fabs(frequency - harmonic * ALIAS_BENCH_FREQUENCY) <= ALIAS_BENCH_MAINLOBE * binWidth;
+    (isHarmonic ? harmonicEnergy : aliasEnergy) += re * re + im * im;
+  }
+  return 10.0 * std::log10(aliasEnergy / harmonicEnergy);
+}
 
-  while (totalWrittenFrames < totalFramesToWrite)
+// silly_synth --bench-synth prints how long every oscillator kernel takes per voice and frame next to ma_waveform,
+// which the voices used before there were kernels, then checks every vector kernel against the scalar one, and
+// last measures the aliasing of the naive, PolyBLEP and wavetable squares and saws. It fails if a vector kernel
+// is off by more than SYNTH_BENCH_TOLERANCE
+int bench_synth()
+{
+  init_oscillator_kernels();
+  float* block = (float*) ma_aligned_malloc(MIXER_BLOCK_FRAMES * sizeof(float), MIX_BUS_ALIGNMENT, NULL);
+  float* otherBlock = (float*) ma_aligned_malloc(MIXER_BLOCK_FRAMES * sizeof(float), MIX_BUS_ALIGNMENT, NULL);
+  OscillatorKernel kernels[KERNEL_SET_COUNT][OSCILLATOR_TYPE_COUNT];
+  for (int set = 0; set < KERNEL_SET_COUNT; set++)
   {
-    ma_uint64 framesWritten;
-    
-    float outputBuffer[bufferLength];
-    data_callback(&device, &outputBuffer, NULL, bufferLength);    
+    if (kernel_set_supported((KernelSet) set))
+    {
+      get_oscillator_kernels((KernelSet) set, kernels[set]);
+    }
+  }
 
-    result = ma_encoder_write_pcm_frames(&encoder, &outputBuffer, bufferLength, &framesWritten); 
-    if (result != MA_SUCCESS) {
-      // Error
-      g_print("encountered an error while exporting\n");
-      
-      exporting = false;
-      
-      return;
+  g_print("%i voices at 48000 Hz, ns per voice and frame\n", SYNTH_BENCH_VOICES);
+  g_print("%-17s %11s", "", "ma_waveform");
+  for (int set = 0; set < KERNEL_SET_COUNT; set++)
+  {
+    g_print(" %8s", kernelSetNames[set]);
+  }
+  g_print("\n");
+  const ma_waveform_type waveformTypes[] = {ma_waveform_type_sine, ma_waveform_type_square, ma_waveform_type_triangle,
+                                            ma_waveform_type_sawtooth};
+  for (int type = 0; type < OSCILLATOR_TYPE_COUNT; type++)
+  {
+    g_print("%-17s", oscillatorTypeNames[type]);
+    if (type <= SAW_OSCILLATOR)
+    {
+      g_print(" %11.3f", time_ma_waveform(waveformTypes[type], block, otherBlock));
     }
-    
-    /*
-    for (int i = 0; i < bufferLength; i++)
+    else
+    {
+      g_print(" %11s", "-");
+    }
+    for (int set = 0; set < KERNEL_SET_COUNT; set++)
     {
-      g_printf("Output for frame %i: %f\n", totalWrittenFrames + 1 + i, outputBuffer[i]);  
+      if (kernel_set_supported((KernelSet) set))
+      {
+        g_print(" %8.3f", time_oscillator_kernel(kernels[set][type], block));
+      }
+      else
+      {
+        g_print(" %8s", "-");
+      }
     }
-    */
+    g_print("\n");
+  }
 
-    totalWrittenFrames += framesWritten;
-    playbackTime = (double)totalWrittenFrames / EXPORT_SAMPLE_RATE;
-    playbackX = (int) (playbackTime * tempo);
-        
+  int mismatches = 0;
+  g_print("\nlargest difference from the scalar kernel\n%-17s", "");
+  for (int set = SCALAR_KERNELS + 1; set < KERNEL_SET_COUNT; set++)
+  {
+    g_print(" %8s", kernelSetNames[set]);
+  }
+  g_print("\n");
+  for (int type = 0; type < OSCILLATOR_TYPE_COUNT; type++)
+  {
+    g_print("%-17s", oscillatorTypeNames[type]);
+    for (int set = SCALAR_KERNELS + 1; set < KERNEL_SET_COUNT; set++)
+    {
+      if (!kernel_set_supported((KernelSet) set))
+      {
+        g_print(" %8s", "-");
+        continue;
+      }
+      float difference = compare_oscillator_kernels(kernels[set][type], kernels[SCALAR_KERNELS][type], block, otherBlock);
+      g_print(" %8.1e", difference);
+      if (difference > SYNTH_BENCH_TOLERANCE)
+      {
+        mismatches++;
+      }
+    }
+    g_print("\n");
+  }
+  ma_aligned_free(block, NULL);
+  ma_aligned_free(otherBlock, NULL);
+
+  g_print("\nalias energy against the harmonics of a %g Hz note at 48000 Hz, with the %s kernels\n",
+          ALIAS_BENCH_FREQUENCY, oscillatorKernelName);
+  const OscillatorType aliasTypes[] = {SQUARE_OSCILLATOR, POLYBLEP_SQUARE_OSCILLATOR, WAVETABLE_SQUARE_OSCILLATOR,
+                                       SAW_OSCILLATOR, POLYBLEP_SAW_OSCILLATOR, WAVETABLE_SAW_OSCILLATOR};
+  for (OscillatorType type : aliasTypes)
+  {
+    g_print("%-17s %8.1f dB\n", oscillatorTypeNames[type], measure_alias_energy(type));
+  }
 
-    // delete[] outputBuffer;
+  if (mismatches > 0)
+  {
+    g_print("%i kernels don't match the scalar ones\n", mismatches);
+    return 1;
   }
-  
-  g_printf("Finished export. Total frames written: %i\n", totalWrittenFrames);
+  return 0;
+}
 
-  exporting = false;
-  playbackX = playbackXSave;
-  playbackTime = playbackTimeSave;
-  ma_encoder_uninit(&encoder);
-  
+GtkWidget* trackGainScale;
+
+// notes drawn from now on go on the selected track, and the gain slider follows it
+static void update_edit_track(GObject* dropDown, GParamSpec* pspec, gpointer data)
+{
+  editBus = gtk_drop_down_get_selected(GTK_DROP_DOWN(dropDown));
+  gtk_range_set_value(GTK_RANGE(trackGainScale), notes.busGains[editBus]);
 }
 
+static void update_edit_pan(GtkRange* range, gpointer data)
+{
+  editPan = (float) gtk_range_get_value(range);
+}
 
+static void update_track_gain(GtkRange* range, gpointer data)
+{
+  float gain = (float) gtk_range_get_value(range);
+  if (gain != notes.busGains[editBus])
+  {
+    notes.busGains[editBus] = gain;
+    notes_changed();
+  }
+}
 
 static void activate (GtkApplication* app, gpointer user_data)
 {
@@ -714,6 +4645,22 @@ static void activate (GtkApplication* app, gpointer user_data)
   gtk_drawing_area_set_content_width(GTK_DRAWING_AREA(pianoRoll), 100);
   gtk_drawing_area_set_content_height(GTK_DRAWING_AREA(pianoRoll), 100);
   gtk_drawing_area_set_draw_func(GTK_DRAWING_AREA(pianoRoll), draw_piano_roll, NULL, NULL);
+  gtk_widget_set_hexpand(pianoRoll, TRUE);
+  gtk_widget_set_vexpand(pianoRoll, TRUE);
+
+  // scrollbars along the bottom and right of the roll, sized when the roll gets its size
+  columnAdjustment = gtk_adjustment_new(0, 0, pianoGridWidth, 1, 1, 1);
+  keyAdjustment = gtk_adjustment_new(0, 0, pianoKeyCount, 1, 1, 1);
+  g_signal_connect(columnAdjustment, "value-changed", G_CALLBACK(scroll_piano_roll_view), (void*) pianoRoll);
+  g_signal_connect(keyAdjustment, "value-changed", G_CALLBACK(scroll_piano_roll_view), (void*) pianoRoll);
+  g_signal_connect(pianoRoll, "resize", G_CALLBACK(resize_piano_roll), NULL);
+
+  GtkWidget* rollBox = gtk_box_new(GTK_ORIENTATION_VERTICAL, 0);
+  GtkWidget* rollRow = gtk_box_new(GTK_ORIENTATION_HORIZONTAL, 0);
+  gtk_box_append(GTK_BOX(rollRow), pianoRoll);
+  gtk_box_append(GTK_BOX(rollRow), gtk_scrollbar_new(GTK_ORIENTATION_VERTICAL, keyAdjustment));
+  gtk_box_append(GTK_BOX(rollBox), rollRow);
+  gtk_box_append(GTK_BOX(rollBox), gtk_scrollbar_new(GTK_ORIENTATION_HORIZONTAL, columnAdjustment));
 
   // piano roll input
 
@@ -725,6 +4672,10 @@ static void activate (GtkApplication* app, gpointer user_data)
   g_signal_connect(pianoRollPrimaryDrag, "drag-update", G_CALLBACK(piano_roll_primary_drag_update), (void*) pianoRoll);
   g_signal_connect(pianoRollPrimaryDrag, "drag-end", G_CALLBACK(piano_roll_primary_drag_end), (void*) pianoRoll);
 
+  GtkEventController* pianoRollScroll = gtk_event_controller_scroll_new(GTK_EVENT_CONTROLLER_SCROLL_BOTH_AXES);
+  g_signal_connect(pianoRollScroll, "scroll", G_CALLBACK(scroll_piano_roll), (void*) pianoRoll);
+  gtk_widget_add_controller(pianoRoll, pianoRollScroll);
+
   // GtkShortcut* undoShortcut = gtk_shortcut_new(gtk_shortcut_trigger_parse_string("<Control>Z"), gtk_callback_action_new((GtkShortcutFunc)handle_undo_shortcut, NULL, NULL));
   
   /*
@@ -742,7 +4693,7 @@ static void activate (GtkApplication* app, gpointer user_data)
   GdkFrameClock* pianoClock = gtk_widget_get_frame_clock(pianoRoll);
   // gdk_frame_clock_end_updating(pianoClock);
 
-  gtk_paned_set_end_child (GTK_PANED(vpaned), pianoRoll);
+  gtk_paned_set_end_child (GTK_PANED(vpaned), rollBox);
   gtk_paned_set_resize_end_child (GTK_PANED(vpaned), TRUE);
 
 
@@ -757,12 +4708,58 @@ static void activate (GtkApplication* app, gpointer user_data)
   gtk_tooltips_set_colors(buttonTooltips, )
   */  
 
-  GtkWidget* exportButton = gtk_button_new_with_label("Export");  
+  exportButton = gtk_button_new_with_label("Export");  
   g_signal_connect (exportButton, "clicked", G_CALLBACK(export_song), NULL);
-  gtk_widget_set_tooltip_markup(exportButton, "<span foreground=\"gray\">Exports song to .wav file (WIP)</span>");
+  gtk_widget_set_tooltip_markup(exportButton, "<span foreground=\"gray\">Exports song to my_file.wav in the background, click again to cancel</span>");
   gtk_box_append(GTK_BOX(menuBox), exportButton);
 
-  const char* instrumentStrings[] = {"sine wave", "square wave", "triangle wave", "saw wave"};
+  exportStatus = gtk_label_new("");
+  gtk_box_append(GTK_BOX(menuBox), exportStatus);
+
+  exportSettings = gtk_box_new(GTK_ORIENTATION_HORIZONTAL, 5);
+  gtk_box_append(GTK_BOX(menuBox), exportSettings);
+
+  const char* rateStrings[] = {"44.1 kHz", "48 kHz", "96 kHz", NULL};
+  GtkWidget* rateSelectButton = gtk_drop_down_new_from_strings(rateStrings);
+  for (int i = 0; i < 3; i++)
+  {
+    if (supportedSampleRates[i] == exportSampleRate)
+    {
+      gtk_drop_down_set_selected(GTK_DROP_DOWN(rateSelectButton), i);
+    }
+  }
+  gtk_widget_set_tooltip_markup(rateSelectButton, "<span foreground=\"gray\">Sample rate of exported files</span>");
+  g_signal_connect(rateSelectButton, "notify::selected", G_CALLBACK(update_export_rate), NULL);
+  gtk_box_append(GTK_BOX(exportSettings), rateSelectButton);
+
+  const char* channelStrings[] = {"mono", "stereo", NULL};
+  GtkWidget* channelSelectButton = gtk_drop_down_new_from_strings(channelStrings);
+  gtk_drop_down_set_selected(GTK_DROP_DOWN(channelSelectButton), exportChannels - 1);
+  gtk_widget_set_tooltip_markup(channelSelectButton, "<span foreground=\"gray\">Channels of exported files</span>");
+  g_signal_connect(channelSelectButton, "notify::selected", G_CALLBACK(update_export_channels), NULL);
+  gtk_box_append(GTK_BOX(exportSettings), channelSelectButton);
+
+  const char* formatStrings[] = {"32-bit float", "16-bit", "24-bit", NULL};
+  GtkWidget* formatSelectButton = gtk_drop_down_new_from_strings(formatStrings);
+  for (int i = 0; i < 3; i++)
+  {
+    if (supportedExportFormats[i] == exportFormat)
+    {
+      gtk_drop_down_set_selected(GTK_DROP_DOWN(formatSelectButton), i);
+    }
+  }
+  gtk_widget_set_tooltip_markup(formatSelectButton, "<span foreground=\"gray\">Sample format of exported files</span>");
+  g_signal_connect(formatSelectButton, "notify::selected", G_CALLBACK(update_export_format), NULL);
+  gtk_box_append(GTK_BOX(exportSettings), formatSelectButton);
+
+  GtkWidget* saveButton = gtk_button_new_with_label("Save");
+  g_signal_connect (saveButton, "clicked", G_CALLBACK(save_song_button), NULL);
+  gtk_widget_set_tooltip_markup(saveButton, "<span foreground=\"gray\">Saves song to my_song.ssy, which silly_synth --render can export</span>");
+  gtk_box_append(GTK_BOX(menuBox), saveButton);
+
+  const char* instrumentStrings[] = {"sine wave", "square wave", "triangle wave", "saw wave",
+                                     "square wave (PolyBLEP)", "saw wave (PolyBLEP)",
+                                     "square wave (wavetable)", "saw wave (wavetable)", NULL};
 
   GtkWidget* instrumentSelectButton = gtk_drop_down_new_from_strings(instrumentStrings);  
   gtk_box_append(GTK_BOX(menuBox), instrumentSelectButton);
@@ -770,6 +4767,26 @@ static void activate (GtkApplication* app, gpointer user_data)
   gtk_widget_set_tooltip_markup(instrumentSelectButton, "<span foreground=\"gray\">Instrument selection</span>");
   g_signal_connect(instrumentSelectButton, "state-flags-changed", G_CALLBACK(update_instrument_select), NULL);
 
+  const char* trackStrings[] = {"track 1", "track 2", "track 3", "track 4", NULL};
+  GtkWidget* trackSelectButton = gtk_drop_down_new_from_strings(trackStrings);
+  gtk_widget_set_tooltip_markup(trackSelectButton, "<span foreground=\"gray\">Track new notes go on, each track is a mixer bus with its own gain</span>");
+  g_signal_connect(trackSelectButton, "notify::selected", G_CALLBACK(update_edit_track), NULL);
+  gtk_box_append(GTK_BOX(menuBox), trackSelectButton);
+
+  GtkWidget* panScale = gtk_scale_new_with_range(GTK_ORIENTATION_HORIZONTAL, -1.0, 1.0, 0.05);
+  gtk_range_set_value(GTK_RANGE(panScale), editPan);
+  gtk_widget_set_size_request(panScale, 80, -1);
+  gtk_widget_set_tooltip_markup(panScale, "<span foreground=\"gray\">Pan of new notes, from left to right</span>");
+  g_signal_connect(panScale, "value-changed", G_CALLBACK(update_edit_pan), NULL);
+  gtk_box_append(GTK_BOX(menuBox), panScale);
+
+  trackGainScale = gtk_scale_new_with_range(GTK_ORIENTATION_HORIZONTAL, 0.0, 2.0, 0.05);
+  gtk_range_set_value(GTK_RANGE(trackGainScale), notes.busGains[editBus]);
+  gtk_widget_set_size_request(trackGainScale, 80, -1);
+  gtk_widget_set_tooltip_markup(trackGainScale, "<span foreground=\"gray\">Gain of the selected track</span>");
+  g_signal_connect(trackGainScale, "value-changed", G_CALLBACK(update_track_gain), NULL);
+  gtk_box_append(GTK_BOX(menuBox), trackGainScale);
+
   GtkWidget* playButton  = gtk_button_new_with_label("Play");
   g_signal_connect (playButton, "clicked", G_CALLBACK(start_playback), (void*) pianoRoll);
   gtk_widget_set_tooltip_markup(playButton, "<span foreground=\"gray\">Begins audio playback</span>");
@@ -801,6 +4818,11 @@ static void activate (GtkApplication* app, gpointer user_data)
   g_signal_connect (redoButton, "clicked", G_CALLBACK(redo), (void*) pianoRoll);
   gtk_widget_set_tooltip_markup(redoButton, "<span foreground=\"gray\">Redoes piano roll action</span>");
   gtk_box_append(GTK_BOX(menuBox), redoButton);
+
+  GtkWidget* loadMeter = gtk_label_new("DSP");
+  gtk_widget_set_tooltip_markup(loadMeter, "<span foreground=\"gray\">Audio callback time as a share of its period, overruns are callbacks that took too long, underruns are estimated from late callbacks</span>");
+  gtk_box_append(GTK_BOX(menuBox), loadMeter);
+  g_timeout_add(LOAD_METER_INTERVAL, update_load_meter, loadMeter);
   
 
 
@@ -818,24 +4840,247 @@ static void activate (GtkApplication* app, gpointer user_data)
 	gtk_window_present(GTK_WINDOW(window));
 }
 
-void delete_waves()
+bool parse_sample_rate(const char* text, ma_uint32* sampleRate)
+{
+  for (ma_uint32 rate : supportedSampleRates)
+  {
+    if ((ma_uint32) atoi(text) == rate)
+    {
+      *sampleRate = rate;
+      return true;
+    }
+  }
+  return false;
+}
+
+bool parse_channels(const char* text, ma_uint32* channels)
+{
+  int count = atoi(text);
+  if (count < 1 || count > MAX_CHANNELS)
+  {
+    return false;
+  }
+  *channels = count;
+  return true;
+}
+
+bool parse_export_format(const char* text, ma_format* format)
+{
+  for (int i = 0; i < (int) (sizeof(supportedExportFormats) / sizeof(supportedExportFormats[0])); i++)
+  {
+    if (strcmp(text, exportFormatNames[i]) == 0)
+    {
+      *format = supportedExportFormats[i];
+      return true;
+    }
+  }
+  return false;
+}
+
+bool parse_oversampling(const char* text, int* factor)
+{
+  int value = atoi(text);
+  if (value != 1 && value != 2 && value != 4)
+  {
+    return false;
+  }
+  *factor = value;
+  return true;
+}
+
+bool parse_resampler_quality(const char* text, ResamplerQuality* quality)
+{
+  for (int i = RESAMPLER_FAST; i <= RESAMPLER_BEST; i++)
+  {
+    if (strcmp(text, resamplerQualityNames[i]) == 0)
+    {
+      *quality = (ResamplerQuality) i;
+      return true;
+    }
+  }
+  return false;
+}
+
+bool parse_voice_count(const char* text, int* count)
+{
+  int value = atoi(text);
+  if (value < 1 || value > MAX_VOICES)
+  {
+    return false;
+  }
+  *count = value;
+  return true;
+}
+
+bool parse_steal_policy(const char* text, VoiceStealPolicy* policy)
+{
+  for (int i = STEAL_OLDEST; i <= STEAL_QUIETEST; i++)
+  {
+    if (strcmp(text, voiceStealPolicyNames[i]) == 0)
+    {
+      *policy = (VoiceStealPolicy) i;
+      return true;
+    }
+  }
+  return false;
+}
+
+// attack,decay,sustain,release with the times in seconds and sustain from 0 to 1
+bool parse_envelope(const char* text, Envelope* envelope)
 {
-  for (int w = 0; w < pianoKeyCount; w++)
+  double attack, decay, sustain, release;
+  char end;
+  if (sscanf(text, "%lf,%lf,%lf,%lf%c", &attack, &decay, &sustain, &release, &end) != 4)
   {
-    ma_waveform_uninit(waves[w]);
-    delete waves[w];
+    return false;
+  }
+  if (attack < 0 || decay < 0 || release < 0 || attack > 10 || decay > 10 || release > 10 || sustain < 0 || sustain > 1)
+  {
+    return false;
   }
-  delete waves;
+  *envelope = {attack, decay, (float) sustain, release};
+  return true;
+}
+
+void print_usage(const char* program)
+{
+  g_print("usage: %s [--device-rate 44100|48000|96000] [--device-channels 1|2] [--device-oversample 1|2|4]\n"
+          "       [--rate 44100|48000|96000] [--channels 1|2] [--format f32|s16|s24] [--oversample 1|2|4]\n"
+          "       [--render-rate 44100|48000|96000] [--resample-quality fast|medium|best]\n"
+          "       [--voices 1-%d] [--steal oldest|quietest] [--envelope attack,decay,sustain,release]\n"
+          "       [--bench-draw] [--bench-synth]\n"
+          "       [--render song.ssy [-o out.wav] [-j threads] [--no-mmap]]\n", program, MAX_VOICES);
 }
 
 int main(int argc, char** argv)
 {
+  // our options are taken out of argv, whatever is left goes to gtk.
+  // headless mode never touches gtk or the audio device
+  const char* renderSongPath = NULL;
+  const char* renderOutputPath = "my_file.wav";
+  bool benchDraw = false;
+  bool benchSynth = false;
+  int gtkArgc = 1;
+  for (int i = 1; i < argc; i++)
+  {
+    const char* option = argv[i];
+    const char* value = i + 1 < argc ? argv[i + 1] : NULL;
+    bool valid = true;
+    bool takesValue = true;
+    if (strcmp(option, "--render") == 0)
+    {
+      renderSongPath = value;
+      valid = value != NULL;
+    }
+    else if (strcmp(option, "-o") == 0)
+    {
+      renderOutputPath = value;
+      valid = value != NULL;
+    }
+    else if (strcmp(option, "-j") == 0)
+    {
+      valid = value != NULL;
+      exportThreadCount = valid ? atoi(value) : 0;
+    }
+    else if (strcmp(option, "--rate") == 0)
+    {
+      valid = value != NULL && parse_sample_rate(value, &exportSampleRate);
+    }
+    else if (strcmp(option, "--channels") == 0)
+    {
+      valid = value != NULL && parse_channels(value, &exportChannels);
+    }
+    else if (strcmp(option, "--format") == 0)
+    {
+      valid = value != NULL && parse_export_format(value, &exportFormat);
+    }
+    else if (strcmp(option, "--render-rate") == 0)
+    {
+      valid = value != NULL && parse_sample_rate(value, &exportRenderSampleRate);
+    }
+    else if (strcmp(option, "--oversample") == 0)
+    {
+      valid = value != NULL && parse_oversampling(value, &exportOversampling);
+    }
+    else if (strcmp(option, "--resample-quality") == 0)
+    {
+      valid = value != NULL && parse_resampler_quality(value, &resamplerQuality);
+    }
+    else if (strcmp(option, "--device-rate") == 0)
+    {
+      valid = value != NULL && parse_sample_rate(value, &deviceSampleRate);
+    }
+    else if (strcmp(option, "--device-channels") == 0)
+    {
+      valid = value != NULL && parse_channels(value, &deviceChannels);
+    }
+    else if (strcmp(option, "--device-oversample") == 0)
+    {
+      valid = value != NULL && parse_oversampling(value, &liveOversampling);
+    }
+    else if (strcmp(option, "--voices") == 0)
+    {
+      valid = value != NULL && parse_voice_count(value, &voiceCount);
+    }
+    else if (strcmp(option, "--steal") == 0)
+    {
+      valid = value != NULL && parse_steal_policy(value, &voiceStealPolicy);
+    }
+    else if (strcmp(option, "--envelope") == 0)
+    {
+      valid = value != NULL && parse_envelope(value, &voiceEnvelope);
+    }
+    else if (strcmp(option, "--bench-draw") == 0)
+    {
+      benchDraw = true;
+      takesValue = false;
+    }
+    else if (strcmp(option, "--bench-synth") == 0)
+    {
+      benchSynth = true;
+      takesValue = false;
+    }
+    else if (strcmp(option, "--no-mmap") == 0)
+    {
+      exportBackend = ENCODER_EXPORT_BACKEND;
+      takesValue = false;
+    }
+    else
+    {
+      argv[gtkArgc++] = argv[i];
+      continue;
+    }
+
+    if (!valid)
+    {
+      print_usage(argv[0]);
+      return 1;
+    }
+    if (takesValue)
+    {
+      i++;
+    }
+  }
+  argc = gtkArgc;
+
+  if (renderSongPath != NULL)
+  {
+    return render_headless(renderSongPath, renderOutputPath);
+  }
+  if (benchDraw)
+  {
+    return bench_draw();
+  }
+  if (benchSynth)
+  {
+    return bench_synth();
+  }
 	
 	
 	ma_device_config config = ma_device_config_init(ma_device_type_playback);
   config.playback.format   = ma_format_f32;   // Set to ma_format_unknown to use the device's native format.
-  config.playback.channels = 1;               // Set to 0 to use the device's native channel count.
-  config.sampleRate        = 48000;           // Set to 0 to use the device's native sample rate.
+  config.playback.channels = deviceChannels;  // Set to 0 to use the device's native channel count.
+  config.sampleRate        = deviceSampleRate; // Set to 0 to use the device's native sample rate.
   config.dataCallback      = data_callback;   // This function will be called when miniaudio needs more data.
   config.pUserData         = NULL;
 
@@ -843,15 +5088,17 @@ int main(int argc, char** argv)
       return -1;  // Failed to initialize the device.
   }
 
-  waves = new ma_waveform*[pianoKeyCount];
-
-  for (int w = 0; w < pianoKeyCount; w++)
+  init_oscillator_kernels();
+  init_voice_pool(&voicePool, SINE_OSCILLATOR, live_sample_rate());
+  init_mix_bus(&deviceBus, std::max(device.playback.internalPeriodSizeInFrames, (ma_uint32) MIX_BUS_MIN_FRAMES), 2);
+  init_mix_bus(&oversampledDeviceBus, deviceBus.capacity * liveOversampling, 2);
+  for (int c = 0; c < 2; c++)
   {
-    ma_waveform* wave = new ma_waveform;
-    waves[w] = wave;
-    ma_waveform_config sineWaveConfig = ma_waveform_config_init(device.playback.format, device.playback.channels, device.sampleRate, ma_waveform_type_sine, 0.2, pitch_from_note(w + baseKeyNote));
-    ma_waveform_init(&sineWaveConfig, wave);
-  }  
+    init_oversampler(&deviceOversamplers[c], liveOversampling, deviceBus.capacity);
+  }
+
+  // the audio thread reads audioNotes as soon as the device starts
+  init_notes();
   
   ma_device_start(&device);     // The device is sleeping by default so you'll need to start it manually.
 
@@ -863,19 +5110,27 @@ int main(int argc, char** argv)
 	app = gtk_application_new("org.gtk.example", G_APPLICATION_FLAGS_NONE);
 	g_signal_connect(app, "activate", G_CALLBACK(activate), NULL);
 
-
-  init_notes();
-
 	// init main loop
 	status = g_application_run(G_APPLICATION(app), argc, argv);
 	
 	// exit
 	g_object_unref(app);
 
-  delete_waves();
+  cancel_export_job();
 
+	// stop the audio thread before freeing anything it reads
 	ma_device_uninit(&device);
 
+  print_callback_stats();
+
+  uninit_mix_bus(&deviceBus);
+  uninit_mix_bus(&oversampledDeviceBus);
+  for (int c = 0; c < 2; c++)
+  {
+    uninit_oversampler(&deviceOversamplers[c]);
+  }
+  uninit_voice_pool(&voicePool);
+
   delete_notes();
 
 	return status;